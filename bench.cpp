@@ -0,0 +1,837 @@
+#include <atomic>
+#include <cerrno>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+#include <algorithm>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QTemporaryDir>
+#include <QString>
+#include <QTextStream>
+#include <QVector>
+#include "latex.h"
+
+// counts heap allocations: by default the ones made through operator new, which misses the buffers
+// Qt allocates with malloc (QString, QByteArray, QVector data); with QT2TEX_BENCH_COUNT_MALLOC (a glibc
+// only build option) every malloc of the process is counted, including the ones made inside Qt
+static std::atomic<qint64> allocations(0);
+
+#ifdef QT2TEX_BENCH_COUNT_MALLOC
+#ifndef __GLIBC__
+#error "QT2TEX_BENCH_COUNT_MALLOC forwards to the glibc allocator and needs glibc"
+#endif
+extern "C" void *__libc_malloc(size_t size);
+extern "C" void *__libc_realloc(void *pointer, size_t size);
+extern "C" void *__libc_calloc(size_t count, size_t size);
+extern "C" void *__libc_memalign(size_t alignment, size_t size);
+
+extern "C" void *malloc(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+extern "C" void *realloc(void *pointer, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(pointer, size);
+}
+
+extern "C" void *calloc(size_t count, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+}
+
+extern "C" void *memalign(size_t alignment, size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_memalign(alignment, size);
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size)
+{
+    return memalign(alignment, size);
+}
+
+extern "C" int posix_memalign(void **pointer, size_t alignment, size_t size)
+{
+    if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *allocated = memalign(alignment, size);
+    if (!allocated && size != 0) {
+        return ENOMEM;
+    }
+    *pointer = allocated;
+    return 0;
+}
+#else
+static void *countedNew(size_t size) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size ? size : 1);
+}
+
+void *operator new(size_t size)
+{
+    if (void *pointer = countedNew(size)) {
+        return pointer;
+    }
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return countedNew(size);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return countedNew(size);
+}
+
+void operator delete(void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete(void *pointer, const std::nothrow_t &) noexcept
+{
+    std::free(pointer);
+}
+
+void operator delete[](void *pointer, const std::nothrow_t &) noexcept
+{
+    std::free(pointer);
+}
+#endif
+
+namespace
+{
+
+// options of the run, see main
+bool jsonOutput = false;
+int repeats = 5;
+QJsonArray results;
+
+class NullSink final: public ITeXElement::Sink
+{
+public:
+    qint64 written = 0;
+
+protected:
+    void write(const QString &buffer) override
+    {
+        written += buffer.size();
+    }
+};
+
+struct Measurement
+{
+    qint64 nsecs = 0;
+    qint64 allocations = 0;
+};
+
+template<class Action>
+Measurement measure(Action action)
+{
+    Measurement result;
+    QElapsedTimer timer;
+    qint64 allocationsBefore = allocations.load();
+    timer.start();
+    action();
+    result.nsecs = timer.nsecsElapsed();
+    result.allocations = allocations.load() - allocationsBefore;
+    return result;
+}
+
+// the run with the median time of `repeats` runs, so a single noisy run does not move the result
+template<class Action>
+Measurement measureMedian(Action action)
+{
+    std::vector<Measurement> runs;
+    for (int i = 0; i < repeats; ++i) {
+        runs.push_back(measure(action));
+    }
+    std::sort(runs.begin(), runs.end(), [](const Measurement &a, const Measurement &b) {
+        return a.nsecs < b.nsecs;
+    });
+    return runs[runs.size() / 2];
+}
+
+// one benchmark result, printed as a text line or collected into the JSON report
+class Result
+{
+public:
+    explicit Result(const QString &name)
+        : _text(name)
+    {
+        _json.insert("name", name);
+    }
+
+    Result &add(const QString &key, double value)
+    {
+        _text.append(QString(" %1=%2").arg(key).arg(value));
+        _json.insert(key, value);
+        return *this;
+    }
+
+    Result &add(const QString &key, qint64 value)
+    {
+        _text.append(QString(" %1=%2").arg(key).arg(value));
+        _json.insert(key, value);
+        return *this;
+    }
+
+    Result &add(const QString &key, int value)
+    {
+        return add(key, qint64(value));
+    }
+
+    Result &add(const QString &key, bool value)
+    {
+        _text.append(QString(" %1=%2").arg(key).arg(value ? 1 : 0));
+        _json.insert(key, value);
+        return *this;
+    }
+
+    Result &add(const QString &key, const QString &value)
+    {
+        _text.append(QString(" %1=%2").arg(key, value));
+        _json.insert(key, value);
+        return *this;
+    }
+
+    void report()
+    {
+        if (jsonOutput) {
+            results.append(_json);
+        }
+        else {
+            std::cout << _text.toUtf8().constData() << std::endl;
+        }
+    }
+
+private:
+    QString _text;
+    QJsonObject _json;
+};
+
+inline QString contentName(bool cyrillic)
+{
+    return cyrillic ? "cyrillic" : "ascii";
+}
+
+std::shared_ptr<LaTeXLongTable> makeTable(int rowsCount, int columnsCount, bool cyrillic = true)
+{
+    QVector<LaTeXLongTable::Column> columns;
+    for (int i = 0; i < columnsCount; ++i) {
+        columns.append(LaTeXLongTable::Column{QString(cyrillic ? "Колонка %1" : "Column %1").arg(i), 'C'});
+    }
+
+    const QString text = cyrillic ? "ППРУ" : "PPRU";
+    auto table = std::make_shared<LaTeXLongTable>(cyrillic ? "Таблица" : "Table", columns);
+    table->rows.reserve(rowsCount);
+    for (int r = 0; r < rowsCount; ++r) {
+        LaTeXLongTable::Row row;
+        for (int c = 0; c < columnsCount; ++c) {
+            row.values.append(c % 2 == 0 ? QString::number(r * columnsCount + c) : text);
+        }
+        table->rows.append(row);
+    }
+    return table;
+}
+
+QVector<std::shared_ptr<ITeXElement>> makeParagraphs(int paragraphsCount, bool cyrillic)
+{
+    const QString sentence = cyrillic
+        ? "Протокол проверки линии связи %1 составлен по результатам измерений."
+        : "Test report of communication line %1 is based on the measurements.";
+    QVector<std::shared_ptr<ITeXElement>> paragraphs;
+    paragraphs.reserve(paragraphsCount);
+    for (int i = 0; i < paragraphsCount; ++i) {
+        paragraphs.append(std::make_shared<LaTeXParagraph>(std::initializer_list<QString>{
+            sentence.arg(i), sentence.arg(i + 1) + LaTeXSymbols::newLine(), sentence.arg(i + 2)
+        }));
+    }
+    return paragraphs;
+}
+
+// row formatting as it was done before the sink API: copy the row, join it, prepend and append
+QString legacyRow(const LaTeXLongTable::Row &source)
+{
+    LaTeXLongTable::Row row = source;
+    QStringList rowValues(row.values);
+    return rowValues.join(" & ").prepend("    ").append(" \\\\ \\hline");
+}
+
+void benchTableRows(int rowsCount, int columnsCount)
+{
+    auto table = makeTable(rowsCount, columnsCount);
+
+    QString legacyOutput;
+    QTextStream legacyStream(&legacyOutput);
+    const QString lineStart = "    ";
+    auto legacy = measureMedian([&]() {
+        for (const auto &row: table->rows) {
+            legacyStream << lineStart << legacyRow(row) << "\n";
+            if (legacyOutput.size() > 1024 * 1024) {
+                legacyStream.flush();
+                legacyOutput.resize(0);
+            }
+        }
+        legacyStream.flush();
+    });
+
+    auto reader = measureMedian([&]() {
+        auto tableReader = table->getReader();
+        while (!tableReader->atEnd()) {
+            legacyStream << lineStart << tableReader->readLine() << "\n";
+            if (legacyOutput.size() > 1024 * 1024) {
+                legacyStream.flush();
+                legacyOutput.resize(0);
+            }
+        }
+        legacyStream.flush();
+    });
+
+    NullSink sink;
+    sink.setLinePrefix(lineStart);
+    auto writer = measureMedian([&]() {
+        table->writeTo(sink);
+        sink.flush();
+    });
+
+    auto print = [rowsCount, columnsCount](const char *path, const Measurement &m) {
+        Result(QString("table_rows/%1").arg(path))
+            .add("rows", rowsCount)
+            .add("cols", columnsCount)
+            .add("ns_per_row", m.nsecs / rowsCount)
+            .add("allocs_per_row", double(m.allocations) / rowsCount)
+            .report();
+    };
+    print("legacy_join", legacy);
+    print("reader", reader);
+    print("sink", writer);
+}
+
+// BaseDocument::render of paragraphs into a sink that drops the output
+void benchRenderParagraphs(int paragraphsCount, bool cyrillic)
+{
+    LaTeXDocument document(makeParagraphs(paragraphsCount, cyrillic));
+    NullSink sink;
+    auto render = measureMedian([&]() {
+        sink.written = 0;
+        document.render(sink);
+    });
+
+    Result("render/paragraphs")
+        .add("paragraphs", paragraphsCount)
+        .add("content", contentName(cyrillic))
+        .add("ns_per_paragraph", render.nsecs / paragraphsCount)
+        .add("allocs_per_paragraph", double(render.allocations) / paragraphsCount)
+        .add("mchars_per_s", render.nsecs > 0 ? double(sink.written) * 1e3 / render.nsecs : 0.0)
+        .report();
+}
+
+// BaseDocument::render of one long table into a sink that drops the output
+void benchRenderTable(int rowsCount, int columnsCount, bool cyrillic)
+{
+    LaTeXDocument document({makeTable(rowsCount, columnsCount, cyrillic)});
+    NullSink sink;
+    auto render = measureMedian([&]() {
+        sink.written = 0;
+        document.render(sink);
+    });
+
+    Result("render/table")
+        .add("rows", rowsCount)
+        .add("cols", columnsCount)
+        .add("content", contentName(cyrillic))
+        .add("ns_per_row", render.nsecs / rowsCount)
+        .add("allocs_per_row", double(render.allocations) / rowsCount)
+        .add("mchars_per_s", render.nsecs > 0 ? double(sink.written) * 1e3 / render.nsecs : 0.0)
+        .report();
+}
+
+// escaping as done by callers before it was built in: one character at a time
+QString legacyEscape(const QString &text)
+{
+    QString result;
+    for (QChar c: text) {
+        switch (c.unicode()) {
+            case '~':
+                result += "\\textasciitilde{}";
+                break;
+            case '^':
+                result += "\\textasciicircum{}";
+                break;
+            case '\\':
+                result += "\\textbackslash{}";
+                break;
+            case '&':
+            case '%':
+            case '$':
+            case '#':
+            case '_':
+            case '{':
+            case '}':
+                result += QChar('\\');
+                result += c;
+                break;
+            default:
+                result += c;
+                break;
+        }
+    }
+    return result;
+}
+
+// cell-sized texts, one in specialEvery has a special character
+void benchEscaping(int textsCount, int specialEvery)
+{
+    QVector<QString> texts;
+    texts.reserve(textsCount);
+    qint64 chars = 0;
+    for (int i = 0; i < textsCount; ++i) {
+        QString text = QString("Участок %1 линия связи ППРУ").arg(i);
+        if (i % specialEvery == 0) {
+            text.append(" 50% & R_1");
+        }
+        chars += text.size();
+        texts.append(text);
+    }
+
+    qint64 checksum = 0;
+    auto legacy = measureMedian([&]() {
+        for (const auto &text: texts) {
+            checksum += legacyEscape(text).size();
+        }
+    });
+    auto escaped = measureMedian([&]() {
+        for (const auto &text: texts) {
+            checksum += LaTeXEscaping::escaped(text).size();
+        }
+    });
+    NullSink sink;
+    auto appended = measureMedian([&]() {
+        for (const auto &text: texts) {
+            sink.appendEscaped(text);
+            sink.endLine();
+        }
+        sink.flush();
+    });
+
+    auto print = [chars, specialEvery, checksum](const char *path, const Measurement &m) {
+        Result(QString("escaping/%1").arg(path))
+            .add("special_every", specialEvery)
+            .add("ns_per_char", double(m.nsecs) / chars)
+            .add("allocs_per_char", double(m.allocations) / chars)
+            .add("checksum", checksum)
+            .report();
+    };
+    print("legacy_per_char", legacy);
+    print("escaped", escaped);
+    print("sink", appended);
+}
+
+// whole document written into a file through QTextStream against TeXFileRenderer (UTF-8 byte sink)
+void benchTexOutput(int rowsCount, int columnsCount, bool cyrillic)
+{
+    LaTeXDocument document({makeTable(rowsCount, columnsCount, cyrillic)});
+    QTemporaryDir tmp;
+    const QString texFile = tmp.filePath("main.tex");
+
+    qint64 bytes = 0;
+    auto textStream = measureMedian([&]() {
+        QFile file(texFile);
+        file.open(QIODevice::WriteOnly | QIODevice::Truncate);
+        QTextStream stream(&file);
+        document.render(stream);
+        stream.flush();
+        file.close();
+    });
+
+    TeXFileRenderer renderer;
+    bool rendered = false;
+    auto texRenderer = measureMedian([&]() {
+        rendered = renderer.render(texFile, document);
+    });
+    bytes = QFileInfo(texFile).size();
+
+    auto print = [rowsCount, columnsCount, cyrillic, bytes](const char *path, const Measurement &m) {
+        Result(QString("tex_output/%1").arg(path))
+            .add("rows", rowsCount)
+            .add("cols", columnsCount)
+            .add("content", contentName(cyrillic))
+            .add("ns_per_row", m.nsecs / rowsCount)
+            .add("allocs_per_row", double(m.allocations) / rowsCount)
+            .add("mb_per_s", m.nsecs > 0 ? double(bytes) * 1e3 / m.nsecs : 0.0)
+            .report();
+    };
+    print("text_stream", textStream);
+    if (rendered) {
+        print("tex_file_renderer", texRenderer);
+    }
+}
+
+// end-to-end pdflatex time of one xltabular against the same rows split into chunks,
+// with split set the chunks are compiled concurrently (PdfFileRenderer::renderSplit)
+// planned tables are longtables with widths computed by LaTeXLayoutPlanner instead of xltabular X columns
+void benchTableCompile(int rowsCount, int chunkRows, bool split = false, bool planned = false)
+{
+    auto table = makeTable(rowsCount, 6);
+    table->setChunkRows(chunkRows);
+    Measurement planning;
+    if (planned) {
+        planning = measure([&]() {
+            LaTeXLayoutPlanner::forLaTeXDocument().plan(*table);
+        });
+    }
+    LaTeXDocument document({table});
+
+    QTemporaryDir tmp;
+    PdfLaTeXFileRenderer renderer(nullptr, 60 * 60 * 1000);
+    bool rendered = false;
+    auto compile = measure([&]() {
+        rendered = split
+            ? renderer.renderSplit(tmp.filePath("table.pdf"), document)
+            : renderer.render(tmp.filePath("table.pdf"), document);
+    });
+
+    Result("table_compile")
+        .add("rows", rowsCount)
+        .add("chunk_rows", chunkRows)
+        .add("split", split)
+        .add("planned", planned)
+        .add("ok", rendered)
+        .add("seconds", double(compile.nsecs) / 1e9)
+        .add("planning_ms", double(planning.nsecs) / 1e6)
+        .report();
+}
+
+// pages of a PDF read by PdfFile, -1 if it can not be read or its page tree count differs from its pages
+int pdfPageCount(const QString &path)
+{
+    PdfFile file;
+    if (!file.load(path)) {
+        return -1;
+    }
+
+    const auto &objects = file.objects();
+    int root = file.rootObject();
+    int pageTree = objects.contains(root) ? PdfFile::reference(objects.value(root).value, "Pages") : 0;
+    if (!objects.contains(pageTree)) {
+        return -1;
+    }
+    int pages = 0;
+    for (const auto &object: objects) {
+        if (object.value.contains("/Type /Page") && !object.value.contains("/Type /Pages")) {
+            ++pages;
+        }
+    }
+    return PdfFile::integer(objects.value(pageTree).value, "Count") == pages ? pages : -1;
+}
+
+// classic PDF with pagesCount empty pages, built without TeX; "endobj" appears in a literal string
+// of the info dictionary, in a comment and in the content streams, where it must not end an object
+QByteArray makeTestPdf(int pagesCount)
+{
+    QVector<QByteArray> objects;
+    QByteArray kids;
+    for (int page = 0; page < pagesCount; ++page) {
+        int pageNumber = 4 + 2 * page;
+        const QByteArray content = "BT (endobj) Tj ET";
+        kids.append(QByteArray::number(pageNumber) + " 0 R ");
+        objects.append("<< /Type /Page /Parent 2 0 R /MediaBox [0 0 100 100] /Contents "
+                       + QByteArray::number(pageNumber + 1) + " 0 R >>");
+        objects.append("<< /Length " + QByteArray::number(content.size()) + " >>\nstream\n" + content
+                       + "\nendstream");
+    }
+    objects.prepend("<< /Title (not endobj \\) here) % endobj in a comment\n>>");
+    objects.prepend("<< /Type /Pages /Kids [ " + kids + "] /Count " + QByteArray::number(pagesCount) + " >>");
+    objects.prepend("<< /Type /Catalog /Pages 2 0 R >>");
+
+    QByteArray pdf = "%PDF-1.5\n";
+    QVector<int> offsets;
+    for (int i = 0; i < objects.count(); ++i) {
+        offsets.append(pdf.size());
+        pdf.append(QByteArray::number(i + 1) + " 0 obj\n" + objects[i] + "\nendobj\n");
+    }
+    int xref = pdf.size();
+    pdf.append("xref\n0 " + QByteArray::number(objects.count() + 1) + "\n0000000000 65535 f \n");
+    for (int offset: offsets) {
+        pdf.append(QByteArray::number(offset).rightJustified(10, '0') + " 00000 n \n");
+    }
+    pdf.append("trailer\n<< /Size " + QByteArray::number(objects.count() + 1) + " /Root 1 0 R /Info 3 0 R >>\n");
+    pdf.append("startxref\n" + QByteArray::number(xref) + "\n%%EOF\n");
+    return pdf;
+}
+
+// PdfFile and PdfConcatenator over PDFs built in memory, runs without TeX
+bool checkPdfInMemory()
+{
+    QTemporaryDir tmp;
+    const QString first = tmp.filePath("first.pdf");
+    const QString second = tmp.filePath("second.pdf");
+    const QString joined = tmp.filePath("joined.pdf");
+    bool written = true;
+    for (const auto &input: {std::make_pair(first, 2), std::make_pair(second, 3)}) {
+        QFile file(input.first);
+        written = written && file.open(QIODevice::WriteOnly) && file.write(makeTestPdf(input.second)) > 0;
+    }
+
+    PdfFile parsed;
+    bool parsedInMemory = parsed.parse(makeTestPdf(1));
+    bool titleKept = false;
+    for (const auto &object: parsed.objects()) {
+        titleKept = titleKept || object.value.contains("(not endobj \\) here)");
+    }
+    int firstPages = written ? pdfPageCount(first) : -1;
+    int joinedPages = written && PdfConcatenator::concatenate({first, second}, joined) ? pdfPageCount(joined) : -1;
+    bool ok = parsedInMemory && titleKept && firstPages == 2 && joinedPages == 5;
+
+    Result("pdf_in_memory")
+        .add("ok", ok)
+        .add("title_kept", titleKept)
+        .add("pages", firstPages)
+        .add("joined_pages", joinedPages)
+        .report();
+    return ok;
+}
+
+// cells are measured by the characters they typeset, escaped values as the values they were escaped from
+bool checkTypesetText()
+{
+    const QString plain = "a&b%c$d#e_f{g}h~i^j\\k";
+    const QString unescaped = LaTeXLayoutPlanner::typesetText(LaTeXEscaping::escaped(plain));
+    const QString markup = LaTeXLayoutPlanner::typesetText("\\textbf{bold} x~y\\\\z");
+    bool ok = unescaped == plain && markup == "bold x y z" && LaTeXLayoutPlanner::typesetText("no markup") == "no markup";
+
+    Result("typeset_text")
+        .add("ok", ok)
+        .add("unescaped", unescaped)
+        .add("markup", markup)
+        .report();
+    return ok;
+}
+
+// round trip of PdfConcatenator: a split render joins the engine PDFs of two parts, the result
+// is read back and joined with itself, page counts must add up
+bool checkPdfConcatenation()
+{
+    auto table = makeTable(3000, 6);
+    table->setChunkRows(1000);
+    LaTeXDocument document({table});
+
+    QTemporaryDir tmp;
+    const QString joined = tmp.filePath("joined.pdf");
+    const QString twice = tmp.filePath("twice.pdf");
+    PdfLaTeXFileRenderer renderer(nullptr, 10 * 60 * 1000);
+    bool rendered = renderer.renderSplit(joined, document, 2);
+    // each part starts a new page
+    int pages = rendered ? pdfPageCount(joined) : -1;
+    int twicePages = pages >= 2 && PdfConcatenator::concatenate({joined, joined}, twice) ? pdfPageCount(twice) : -1;
+    bool ok = pages >= 2 && twicePages == 2 * pages;
+
+    Result("pdf_concatenation")
+        .add("ok", ok)
+        .add("pages", pages)
+        .add("twice_pages", twicePages)
+        .report();
+    return ok;
+}
+
+// planning of a table measured per character and with font metrics (TFM of DefaultLaTeXPreamble and
+// the main font of LuaDocument), fonts are looked up once outside the measurement
+void benchLayoutPlanning(int rowsCount)
+{
+    auto table = makeTable(rowsCount, 6);
+    const QVector<std::pair<QString, std::shared_ptr<const FontMetrics>>> measures = {
+        {"average", nullptr},
+        {"tfm", TfmMetrics::find("larm1000", TfmMetrics::Encoding::T2A, 10)},
+        {"opentype", OpenTypeMetrics::find(LuaDocument::Options().mainFont, 10)}
+    };
+    for (const auto &measured: measures) {
+        if (measured.first != "average" && !measured.second) {
+            Result("layout_planning").add("rows", rowsCount).add("measure", measured.first).add("ok", false).report();
+            continue;
+        }
+        LaTeXLayoutPlanner planner = LaTeXLayoutPlanner::forLaTeXDocument();
+        planner.setFontMetrics(measured.second);
+        bool planned = false;
+        auto planning = measureMedian([&]() {
+            planned = planner.plan(*table);
+        });
+
+        Result("layout_planning")
+            .add("rows", rowsCount)
+            .add("measure", measured.first)
+            .add("ok", planned)
+            .add("ms", double(planning.nsecs) / 1e6)
+            .add("columns", table->plannedColumns().join(' '))
+            .report();
+    }
+}
+
+// end-to-end latency of a small report (a paragraph and a 50-row table with a page counter)
+// in the document class written for the engine
+template<class Document>
+void benchPdfLatency(const QString &engine, PdfFileRenderer &renderer)
+{
+    auto paragraph = std::make_shared<LaTeXParagraph>(std::initializer_list<QString>{
+        "Протокол проверки линии связи.",
+        QString("Страниц: %1").arg(LaTeXSymbols::totalPages())
+    });
+    Document document({paragraph, makeTable(50, 6)});
+
+    QTemporaryDir tmp;
+    std::vector<qint64> nsecs;
+    bool rendered = true;
+    for (int i = 0; i < repeats; ++i) {
+        auto render = measure([&]() {
+            rendered = renderer.render(tmp.filePath("report.pdf"), document) && rendered;
+        });
+        nsecs.push_back(render.nsecs);
+    }
+    std::sort(nsecs.begin(), nsecs.end());
+
+    // engine time of the last render, the rest of the wall time is TeX generation and file handling
+    const auto &report = renderer.lastReport();
+    // CPU time is known for processes of Launcher::PosixSpawn only, -1 otherwise
+    qint64 engineNSecs = 0;
+    qint64 cpuUSecs = 0;
+    for (const auto &command: report.commands) {
+        engineNSecs += command.wallNSecs;
+        if (command.userCpuUSecs < 0 || command.systemCpuUSecs < 0 || cpuUSecs < 0) {
+            cpuUSecs = -1;
+            continue;
+        }
+        cpuUSecs += command.userCpuUSecs + command.systemCpuUSecs;
+    }
+
+    Result("pdf_latency")
+        .add("engine", engine)
+        .add("ok", rendered)
+        .add("min_ms", double(nsecs.front()) / 1e6)
+        .add("median_ms", double(nsecs[nsecs.size() / 2]) / 1e6)
+        .add("passes", renderer.lastPassCount())
+        .add("engine_ms", double(engineNSecs) / 1e6)
+        .add("engine_cpu_ms", cpuUSecs < 0 ? -1.0 : double(cpuUSecs) / 1e3)
+        .add("tex_bytes", report.texBytes)
+        .add("pages", report.pageCount)
+        .report();
+}
+
+}
+
+// qt2tex_bench [--checks] [--compile] [--json] [--repeats=N]
+//   --checks     runs only the checks that need no TeX (the ctest test)
+//   --compile    also runs pdflatex and lualatex benchmarks
+//   --json       prints one JSON report instead of text lines
+//   --repeats=N  runs of every measurement, the median is reported (5 by default)
+int main(int argc, char *argv[])
+{
+    bool checksOnly = false;
+    bool compile = false;
+    for (int i = 1; i < argc; ++i) {
+        const QString arg(argv[i]);
+        if (arg == "--checks") {
+            checksOnly = true;
+        }
+        else if (arg == "--compile") {
+            compile = true;
+        }
+        else if (arg == "--json") {
+            jsonOutput = true;
+        }
+        else if (arg.startsWith("--repeats=")) {
+            repeats = qMax(1, arg.mid(10).toInt());
+        }
+        else {
+            std::cerr << "usage: qt2tex_bench [--checks] [--compile] [--json] [--repeats=N]" << std::endl;
+            return 1;
+        }
+    }
+
+    // a failed check fails the run
+    int status = 0;
+    for (bool passed: {checkPdfInMemory(), checkTypesetText()}) {
+        status = passed ? status : 1;
+    }
+    if (checksOnly) {
+        return status;
+    }
+
+    for (int columnsCount: {3, 10, 20}) {
+        benchTableRows(100000, columnsCount);
+    }
+    for (bool cyrillic: {true, false}) {
+        benchRenderParagraphs(10000, cyrillic);
+        for (int rowsCount: {10000, 100000}) {
+            for (int columnsCount: {3, 10, 20}) {
+                benchRenderTable(rowsCount, columnsCount, cyrillic);
+            }
+        }
+        for (int columnsCount: {3, 10}) {
+            benchTexOutput(100000, columnsCount, cyrillic);
+        }
+    }
+    for (int specialEvery: {1, 10, 1000}) {
+        benchEscaping(200000, specialEvery);
+    }
+
+    // needs TeX Live, so it runs only on request
+    if (compile) {
+        if (!checkPdfConcatenation()) {
+            status = 1;
+        }
+        PdfLaTeXFileRenderer pdflatex(nullptr, 60 * 1000);
+        LuaLaTeXFileRenderer lualatex(nullptr, 60 * 1000);
+#ifdef Q_OS_UNIX
+        // engine CPU time is measured per process by wait4
+        pdflatex.setLauncher(PdfFileRenderer::Launcher::PosixSpawn);
+        lualatex.setLauncher(PdfFileRenderer::Launcher::PosixSpawn);
+#endif
+        benchPdfLatency<LaTeXDocument>("pdflatex", pdflatex);
+        benchPdfLatency<LuaDocument>("lualatex", lualatex);
+        benchLayoutPlanning(50000);
+        for (int rowsCount: {1000, 5000, 20000, 50000}) {
+            benchTableCompile(rowsCount, 0);
+            benchTableCompile(rowsCount, 1000);
+            benchTableCompile(rowsCount, 1000, true);
+            benchTableCompile(rowsCount, 0, false, true);
+            benchTableCompile(rowsCount, 1000, false, true);
+        }
+    }
+
+    if (jsonOutput) {
+        QJsonObject report;
+        report.insert("suite", "qt2tex");
+        report.insert("repeats", repeats);
+#ifdef QT2TEX_BENCH_COUNT_MALLOC
+        report.insert("allocations_counted", "malloc");
+#else
+        report.insert("allocations_counted", "operator_new");
+#endif
+        report.insert("results", results);
+        std::cout << QJsonDocument(report).toJson().constData();
+    }
+
+    return status;
+}
@@ -0,0 +1,451 @@
+#ifndef FONTMETRICS_H
+#define FONTMETRICS_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QProcess>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <memory>
+
+// widths of texts set in a font, for layout decisions made without TeX; kerning and ligatures are
+// not applied. Advances are cached per code point, so an instance must not be shared between threads
+class FontMetrics
+{
+public:
+    virtual ~FontMetrics() = default;
+
+    inline double sizePt() const
+    {
+        return _sizePt;
+    }
+
+    // width of text set in one line, spaces at their natural width
+    double widthPt(const QString &text) const
+    {
+        double width = 0;
+        for (int i = 0; i < text.size(); ++i) {
+            uint codePoint = text[i].unicode();
+            if (text[i].isHighSurrogate() && i + 1 < text.size() && text[i + 1].isLowSurrogate()) {
+                codePoint = QChar::surrogateToUcs4(text[i], text[i + 1]);
+                ++i;
+            }
+            width += codePoint == ' ' ? spacePt() : advancePt(codePoint);
+        }
+        return width;
+    }
+
+    inline double widthMm(const QString &text) const
+    {
+        return widthPt(text) * MmPerPt;
+    }
+
+    // lines of text broken at spaces into lines of lineWidthPt as a ragged paragraph is broken,
+    // a word wider than a line takes a line of its own; empty text takes a line too
+    int lineCount(const QString &text, double lineWidthPt) const
+    {
+        const double space = spacePt();
+        int lines = 1;
+        double lineWidth = 0;
+        for (const auto &word: text.split(QLatin1Char(' '))) {
+            if (word.isEmpty()) {
+                continue;
+            }
+            double width = widthPt(word);
+            if (lineWidth == 0) {
+                lineWidth = width;
+            }
+            else if (lineWidth + space + width <= lineWidthPt) {
+                lineWidth += space + width;
+            }
+            else {
+                ++lines;
+                lineWidth = width;
+            }
+        }
+        return lines;
+    }
+
+protected:
+    explicit FontMetrics(double sizePt)
+        : _sizePt(sizePt)
+    {}
+
+    // advance of the glyph of codePoint in pt, negative if the font has none
+    virtual double glyphAdvancePt(uint codePoint) const = 0;
+
+    // natural interword space in pt
+    virtual double spacePt() const = 0;
+
+    // first line of the standard output of program, empty if it fails
+    static QString outputLine(const QString &program, const QStringList &arguments)
+    {
+        QProcess process;
+        process.start(program, arguments);
+        if (!process.waitForFinished() || process.exitStatus() != QProcess::NormalExit || process.exitCode() != 0) {
+            return {};
+        }
+
+        return QString::fromLocal8Bit(process.readAllStandardOutput()).section(QLatin1Char('\n'), 0, 0).trimmed();
+    }
+
+    static inline quint32 readU32(const QByteArray &data, qint64 offset)
+    {
+        if (offset < 0 || offset + 4 > data.size()) {
+            return 0;
+        }
+        const auto *bytes = reinterpret_cast<const uchar *>(data.constData() + offset);
+        return quint32(bytes[0]) << 24 | quint32(bytes[1]) << 16 | quint32(bytes[2]) << 8 | bytes[3];
+    }
+
+    static inline quint16 readU16(const QByteArray &data, qint64 offset)
+    {
+        if (offset < 0 || offset + 2 > data.size()) {
+            return 0;
+        }
+        const auto *bytes = reinterpret_cast<const uchar *>(data.constData() + offset);
+        return quint16(bytes[0] << 8 | bytes[1]);
+    }
+
+private:
+    double _sizePt;
+    mutable QHash<uint, double> _advances;
+    mutable double _missingAdvancePt = -1;
+
+    const double MmPerPt = 25.4 / 72.27;
+
+    // a code point without a glyph is as wide as n
+    double advancePt(uint codePoint) const
+    {
+        auto found = _advances.constFind(codePoint);
+        if (found != _advances.constEnd()) {
+            return found.value();
+        }
+
+        double advance = glyphAdvancePt(codePoint);
+        if (advance < 0) {
+            if (_missingAdvancePt < 0) {
+                _missingAdvancePt = glyphAdvancePt('n');
+                if (_missingAdvancePt < 0) {
+                    _missingAdvancePt = _sizePt / 2;
+                }
+            }
+            advance = _missingAdvancePt;
+        }
+        _advances.insert(codePoint, advance);
+        return advance;
+    }
+};
+
+// metrics of a pdflatex font from its TFM file; the font is scaled from its design size to sizePt
+class TfmMetrics final: public FontMetrics
+{
+public:
+    // font encoding, maps code points to the character codes of the TFM
+    enum class Encoding
+    {
+        // ASCII and the accented letters of Latin-1
+        T1,
+        // ASCII and Russian Cyrillic
+        T2A
+    };
+
+    TfmMetrics(Encoding encoding, double sizePt)
+        : FontMetrics(sizePt), _encoding(encoding)
+    {}
+
+    // TFM of font found by kpsewhich, e.g. larm1000 (T2A, the default encoding of DefaultLaTeXPreamble)
+    // or ecrm1000 (T1); nullptr if it is not found or can not be read
+    static std::shared_ptr<TfmMetrics> find(const QString &font, Encoding encoding, double sizePt)
+    {
+        const QString path = outputLine("kpsewhich", {font + ".tfm"});
+        auto metrics = std::make_shared<TfmMetrics>(encoding, sizePt);
+        if (path.isEmpty() || !metrics->load(path)) {
+            return nullptr;
+        }
+        return metrics;
+    }
+
+    bool load(const QString &path)
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+        const QByteArray data = file.readAll();
+        file.close();
+
+        // lengths in 4-byte words: lf, lh, bc, ec, nw, nh, nd, ni, nl, nk, ne, np
+        if (data.size() < 24) {
+            return false;
+        }
+        int lengths[12];
+        for (int i = 0; i < 12; ++i) {
+            lengths[i] = readU16(data, 2 * i);
+        }
+        const int headerWords = lengths[1];
+        const int firstCode = lengths[2];
+        const int lastCode = lengths[3];
+        const int widthsCount = lengths[4];
+        const int paramsCount = lengths[11];
+        if (qint64(lengths[0]) * 4 > data.size() || lastCode > 255 || lastCode + 1 < firstCode) {
+            return false;
+        }
+
+        const int charInfo = 6 + headerWords;
+        const int widths = charInfo + lastCode - firstCode + 1;
+        int params = widths;
+        for (int i = 4; i < 11; ++i) {
+            params += lengths[i];
+        }
+        if (qint64(params + paramsCount) * 4 > data.size()) {
+            return false;
+        }
+
+        _widths.fill(-1, 256);
+        for (int code = firstCode; code <= lastCode; ++code) {
+            int widthIndex = uchar(data[4 * (charInfo + code - firstCode)]);
+            if (widthIndex > 0 && widthIndex < widthsCount) {
+                _widths[code] = fixWord(data, widths + widthIndex);
+            }
+        }
+        // the second parameter is the interword space
+        _space = paramsCount >= 2 ? fixWord(data, params + 1) : 0;
+        return true;
+    }
+
+protected:
+    double glyphAdvancePt(uint codePoint) const override
+    {
+        int code = characterCode(codePoint);
+        if (code < 0 || code >= _widths.count() || _widths[code] < 0) {
+            return -1;
+        }
+        return _widths[code] * sizePt();
+    }
+
+    double spacePt() const override
+    {
+        return _space * sizePt();
+    }
+
+private:
+    Encoding _encoding;
+    // in design sizes, negative for missing characters
+    QVector<double> _widths;
+    double _space = 0;
+
+    // fix_word of the TFM word index: signed with 20 fraction bits
+    static inline double fixWord(const QByteArray &data, int word)
+    {
+        return qint32(readU32(data, 4 * qint64(word))) / double(1 << 20);
+    }
+
+    int characterCode(uint codePoint) const
+    {
+        if (codePoint >= 0x21 && codePoint <= 0x7E) {
+            return int(codePoint);
+        }
+        if (_encoding == Encoding::T2A) {
+            if (codePoint >= 0x0410 && codePoint <= 0x044F) {
+                return int(0xC0 + codePoint - 0x0410);
+            }
+            if (codePoint == 0x0401) {
+                return 0x9C;
+            }
+            if (codePoint == 0x0451) {
+                return 0xBC;
+            }
+            return -1;
+        }
+
+        // T1 keeps the Latin-1 letters at their codes, except for sharp s and y with diaeresis
+        if (codePoint == 0xDF) {
+            return 0xFF;
+        }
+        if (codePoint == 0xFF) {
+            return 0xB8;
+        }
+        if (codePoint >= 0xC0 && codePoint <= 0xFE && codePoint != 0xD7 && codePoint != 0xF7) {
+            return int(codePoint);
+        }
+        return -1;
+    }
+};
+
+// metrics of a lualatex (fontspec) font from the cmap and hmtx tables of its TrueType or OpenType file
+class OpenTypeMetrics final: public FontMetrics
+{
+public:
+    explicit OpenTypeMetrics(double sizePt)
+        : FontMetrics(sizePt)
+    {}
+
+    // file of family found by fc-match, e.g. "Liberation Serif" of LuaDocument; nullptr if it is not found
+    // or can not be read (fc-match may answer with a substitute family)
+    static std::shared_ptr<OpenTypeMetrics> find(const QString &family, double sizePt)
+    {
+        const QString path = outputLine("fc-match", {"--format=%{file}", family});
+        auto metrics = std::make_shared<OpenTypeMetrics>(sizePt);
+        if (path.isEmpty() || !metrics->load(path)) {
+            return nullptr;
+        }
+        return metrics;
+    }
+
+    bool load(const QString &path)
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+        _data = file.readAll();
+        file.close();
+
+        quint32 version = readU32(_data, 0);
+        if (version != 0x00010000 && version != 0x74727565 && version != 0x4F54544F) {
+            return false;
+        }
+        qint64 head = -1;
+        qint64 hhea = -1;
+        qint64 cmap = -1;
+        int tablesCount = readU16(_data, 4);
+        for (int i = 0; i < tablesCount; ++i) {
+            const qint64 record = 12 + 16 * qint64(i);
+            const QByteArray tag = _data.mid(int(record), 4);
+            const qint64 offset = readU32(_data, record + 8);
+            if (tag == "head") {
+                head = offset;
+            }
+            else if (tag == "hhea") {
+                hhea = offset;
+            }
+            else if (tag == "hmtx") {
+                _hmtx = offset;
+            }
+            else if (tag == "cmap") {
+                cmap = offset;
+            }
+        }
+        if (head < 0 || hhea < 0 || _hmtx < 0 || cmap < 0) {
+            return false;
+        }
+
+        _unitsPerEm = readU16(_data, head + 18);
+        _hMetricsCount = readU16(_data, hhea + 34);
+        if (_unitsPerEm == 0 || _hMetricsCount == 0) {
+            return false;
+        }
+
+        // a full Unicode map (format 12) is preferred to a BMP one (format 4)
+        int subtablesCount = readU16(_data, cmap + 2);
+        for (int i = 0; i < subtablesCount; ++i) {
+            const qint64 record = cmap + 4 + 8 * qint64(i);
+            int platform = readU16(_data, record);
+            int encoding = readU16(_data, record + 2);
+            const qint64 subtable = cmap + readU32(_data, record + 4);
+            int format = readU16(_data, subtable);
+            bool unicode = platform == 0 || (platform == 3 && (encoding == 1 || encoding == 10));
+            if (unicode && format == 12) {
+                _cmapFormat = 12;
+                _cmap = subtable;
+                break;
+            }
+            if (unicode && format == 4 && _cmapFormat != 4) {
+                _cmapFormat = 4;
+                _cmap = subtable;
+            }
+        }
+        return _cmapFormat != 0;
+    }
+
+protected:
+    double glyphAdvancePt(uint codePoint) const override
+    {
+        uint glyph = glyphIndex(codePoint);
+        if (glyph == 0) {
+            return -1;
+        }
+        uint metric = qMin(glyph, uint(_hMetricsCount - 1));
+        return double(readU16(_data, _hmtx + 4 * qint64(metric))) / _unitsPerEm * sizePt();
+    }
+
+    double spacePt() const override
+    {
+        double space = glyphAdvancePt(' ');
+        return space < 0 ? sizePt() / 4 : space;
+    }
+
+private:
+    QByteArray _data;
+    qint64 _hmtx = -1;
+    qint64 _cmap = -1;
+    int _cmapFormat = 0;
+    int _unitsPerEm = 0;
+    int _hMetricsCount = 0;
+
+    // 0 (.notdef) if the font has no glyph for codePoint
+    uint glyphIndex(uint codePoint) const
+    {
+        if (_cmapFormat == 12) {
+            // groups of consecutive code points sorted by start
+            qint64 low = 0;
+            qint64 high = qint64(readU32(_data, _cmap + 12)) - 1;
+            while (low <= high) {
+                qint64 middle = (low + high) / 2;
+                const qint64 group = _cmap + 16 + 12 * middle;
+                quint32 start = readU32(_data, group);
+                quint32 end = readU32(_data, group + 4);
+                if (codePoint < start) {
+                    high = middle - 1;
+                }
+                else if (codePoint > end) {
+                    low = middle + 1;
+                }
+                else {
+                    return readU32(_data, group + 8) + codePoint - start;
+                }
+            }
+            return 0;
+        }
+
+        if (codePoint > 0xFFFF) {
+            return 0;
+        }
+        // segments sorted by end code
+        const int segmentsCount = readU16(_data, _cmap + 6) / 2;
+        const qint64 ends = _cmap + 14;
+        const qint64 starts = ends + 2 * qint64(segmentsCount) + 2;
+        const qint64 deltas = starts + 2 * qint64(segmentsCount);
+        const qint64 rangeOffsets = deltas + 2 * qint64(segmentsCount);
+        int low = 0;
+        int high = segmentsCount - 1;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (readU16(_data, ends + 2 * middle) < codePoint) {
+                low = middle + 1;
+            }
+            else {
+                high = middle;
+            }
+        }
+        if (segmentsCount == 0 || readU16(_data, ends + 2 * low) < codePoint
+            || readU16(_data, starts + 2 * low) > codePoint) {
+            return 0;
+        }
+
+        quint16 delta = readU16(_data, deltas + 2 * low);
+        quint16 rangeOffset = readU16(_data, rangeOffsets + 2 * low);
+        if (rangeOffset == 0) {
+            return quint16(codePoint + delta);
+        }
+        const qint64 glyphAddress =
+            rangeOffsets + 2 * low + rangeOffset + 2 * qint64(codePoint - readU16(_data, starts + 2 * low));
+        quint16 glyph = readU16(_data, glyphAddress);
+        return glyph == 0 ? 0 : quint16(glyph + delta);
+    }
+};
+
+#endif //FONTMETRICS_H
@@ -6,13 +6,60 @@
 #include <QFile>
 #include <QString>
 #include <QVector>
+#include <QHash>
+#include <QDateTime>
+#include <QTimeZone>
 #include <QTextStream>
 #include <QFile>
 #include <QFileInfo>
 #include <QProcess>
 #include <QTemporaryFile>
 #include <QTemporaryDir>
+#include <QCryptographicHash>
+#include <QDir>
+#include <QThread>
+#include <QTimer>
+#include <QFuture>
+#include <QFutureInterface>
+#include <QFutureWatcher>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <thread>
+#include <vector>
 #include <utility>
+#include <QElapsedTimer>
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char **environ;
+#endif
+#ifdef Q_OS_LINUX
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#include "fontmetrics.h"
+#include "pdf.h"
 
 struct LaTeXSymbols
 {
@@ -22,631 +69,5138 @@ struct LaTeXSymbols
     static inline QString totalPages()
     { return "\\pageref{LastPage}"; }
 
+    // true if text uses a command whose value is known only after a previous engine pass
+    static bool hasCrossReference(const QChar *text, int size);
+
     LaTeXSymbols() = delete;
-};
 
-class ITeXElement
-{
-public:
-    class IReader
+private:
+    static inline bool isLetter(QChar c)
     {
-    public:
-        virtual QString readLine() = 0;
-
-        virtual bool atEnd() const = 0;
-
-        virtual ~IReader() = default;
-    };
+        ushort u = c.unicode();
+        return (u >= 'a' && u <= 'z') || (u >= 'A' && u <= 'Z');
+    }
 
-    virtual std::unique_ptr<IReader> getReader() const = 0;
+    static bool isCommand(const QChar *name, int size, const char *command)
+    {
+        int i = 0;
+        for (; i < size && command[i] != '\0'; ++i) {
+            if (name[i] != QLatin1Char(command[i])) {
+                return false;
+            }
+        }
+        return i == size && command[i] == '\0';
+    }
 };
 
-class LaTeXParagraph final: public ITeXElement
+// escaping of the LaTeX special characters & % $ # _ { } ~ ^ \ in plain text; text is scanned
+// 32 code units at a time with AVX2 or 16 with SSE2, runs without special characters are copied wholesale
+struct LaTeXEscaping
 {
-public:
-    QVector<QString> sentences;
-
-    LaTeXParagraph() = default;
+    // text itself (shared, not copied) if it has nothing to escape
+    static QString escaped(const QString &text)
+    {
+        int first = findSpecial(text.constData(), 0, text.size());
+        if (first == text.size()) {
+            return text;
+        }
 
-    LaTeXParagraph(std::initializer_list<QString> sentences)
-        : sentences(sentences)
-    {}
+        QString result;
+        result.reserve(text.size() + 16);
+        result.append(text.constData(), first);
+        escape(text.constData() + first, text.size() - first, result);
+        return result;
+    }
 
-    std::unique_ptr<IReader> getReader() const override
+    static void escape(const QChar *text, int size, QString &out)
     {
-        return std::unique_ptr<Reader>(new Reader(this));
+        int runStart = 0;
+        while (runStart < size) {
+            int special = findSpecial(text, runStart, size);
+            out.append(text + runStart, special - runStart);
+            if (special == size) {
+                break;
+            }
+            appendReplacement(text[special].unicode(), out);
+            runStart = special + 1;
+        }
     }
 
-private:
-    class Reader final: public IReader
+    // index of the first special character at or after from, size if there is none
+    static int findSpecial(const QChar *text, int from, int size)
     {
-    public:
-        explicit Reader(const LaTeXParagraph *source)
-            : _source(source)
-        {}
-
-        QString readLine() override
-        {
-            QString result;
-            if (atEnd()) {
-                result = "";
+        const ushort *units = reinterpret_cast<const ushort *>(text);
+        int i = from;
+#if defined(__AVX2__)
+        for (; i + 32 <= size; i += 32) {
+            __m256i low = specials(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(units + i)));
+            __m256i high = specials(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(units + i + 16)));
+            __m256i found = _mm256_or_si256(low, high);
+            if (!_mm256_testz_si256(found, found)) {
+                break;
             }
-            else {
-                result = _source->sentences[_position];
+        }
+#elif defined(__SSE2__) || defined(_M_X64)
+        for (; i + 16 <= size; i += 16) {
+            __m128i low = specials(_mm_loadu_si128(reinterpret_cast<const __m128i *>(units + i)));
+            __m128i high = specials(_mm_loadu_si128(reinterpret_cast<const __m128i *>(units + i + 8)));
+            if (_mm_movemask_epi8(_mm_or_si128(low, high)) != 0) {
+                break;
             }
-
-            ++_position;
-            return result;
         }
-
-        inline bool atEnd() const override
-        {
-            return _position == _source->sentences.count();
+#endif
+        // the block with a special character and the tail are scanned one unit at a time
+        for (; i < size; ++i) {
+            if (isSpecial(units[i])) {
+                return i;
+            }
         }
+        return size;
+    }
 
-        ~Reader() override = default;
-
-    private:
-        const LaTeXParagraph *_source;
-        int _position = 0;
-    };
-};
+    LaTeXEscaping() = delete;
 
-class LaTeXLongTable: public ITeXElement
-{
-public:
-    struct Column
+private:
+    static inline bool isSpecial(ushort unit)
     {
-        Column() = default;
-
-        Column(QString name, const QChar &type)
-            : name(std::move(name)), type(type)
-        {}
-
-        QString name;
-        QChar type;
-    };
+        switch (unit) {
+            case '&':
+            case '%':
+            case '$':
+            case '#':
+            case '_':
+            case '{':
+            case '}':
+            case '~':
+            case '^':
+            case '\\':
+                return true;
+            default:
+                return false;
+        }
+    }
 
-    struct Row
+    static void appendReplacement(ushort unit, QString &out)
     {
-        Row() = default;
+        switch (unit) {
+            case '~':
+                out.append(QLatin1String("\\textasciitilde{}"));
+                break;
+            case '^':
+                out.append(QLatin1String("\\textasciicircum{}"));
+                break;
+            case '\\':
+                out.append(QLatin1String("\\textbackslash{}"));
+                break;
+            default:
+                out.append(QLatin1Char('\\'));
+                out.append(QChar(unit));
+                break;
+        }
+    }
 
-        Row(std::initializer_list<QString> values)
-            : values(values)
-        {}
+#if defined(__AVX2__)
+    static inline __m256i specials(__m256i units)
+    {
+        __m256i found = _mm256_cmpeq_epi16(units, _mm256_set1_epi16('&'));
+        for (short special: {'%', '$', '#', '_', '{', '}', '~', '^', '\\'}) {
+            found = _mm256_or_si256(found, _mm256_cmpeq_epi16(units, _mm256_set1_epi16(special)));
+        }
+        return found;
+    }
+#elif defined(__SSE2__) || defined(_M_X64)
+    static inline __m128i specials(__m128i units)
+    {
+        __m128i found = _mm_cmpeq_epi16(units, _mm_set1_epi16('&'));
+        for (short special: {'%', '$', '#', '_', '{', '}', '~', '^', '\\'}) {
+            found = _mm_or_si128(found, _mm_cmpeq_epi16(units, _mm_set1_epi16(special)));
+        }
+        return found;
+    }
+#endif
+};
 
-        QList<QString> values;
+// jumps between special characters with LaTeXEscaping::findSpecial, so text without commands
+// (most table cells) is skipped a vector at a time
+inline bool LaTeXSymbols::hasCrossReference(const QChar *text, int size)
+{
+    static const char *const commands[] = {
+        "pageref", "ref", "eqref", "autoref", "nameref", "vref", "cref", "Cref", "cite",
+        "tableofcontents", "listoffigures", "listoftables"
     };
 
-    LaTeXLongTable(QString label, QVector<Column> columns)
-        : _label(std::move(label)), _columns(std::move(columns))
-    {}
-
-    QVector<Row> rows;
-
-    std::unique_ptr<IReader> getReader() const override
-    {
-        return std::unique_ptr<Reader>(new Reader(this));
+    for (int i = LaTeXEscaping::findSpecial(text, 0, size); i < size;
+         i = LaTeXEscaping::findSpecial(text, i + 1, size)) {
+        if (text[i] != QLatin1Char('\\')) {
+            continue;
+        }
+        int nameEnd = i + 1;
+        while (nameEnd < size && isLetter(text[nameEnd])) {
+            ++nameEnd;
+        }
+        for (const char *command: commands) {
+            if (isCommand(text + i + 1, nameEnd - i - 1, command)) {
+                return true;
+            }
+        }
+        // control symbols such as \\ consume the next character
+        i = nameEnd == i + 1 ? nameEnd : nameEnd - 1;
     }
 
-private:
-    QString _label;
-    QVector<Column> _columns;
+    return false;
+}
 
-    class Reader: public IReader
+class ITeXElement
+{
+public:
+    // push-style output target, elements append their lines into a reusable buffer
+    class Sink
     {
     public:
-        explicit Reader(const LaTeXLongTable *parent)
-            : _parent(parent)
-        {}
-
-        QString readLine() override
+        explicit Sink(int flushThreshold = DefaultFlushThreshold)
+            : _flushThreshold(flushThreshold)
         {
-            if (atEnd()) {
-                return {};
-            }
+            _buffer.reserve(flushThreshold + flushThreshold / 4);
+        }
 
-            QString result;
-            if (_position == 0) {
-                result = getTableBegin();
-            }
-            else if (_position == 1) {
-                result = getTableLabel();
-            }
-            else if (_position == 2) {
-                result = getTableHeader();
-            }
-            else if (allRowsReady()) {
-                result = TableEnd;
-            }
-            else {
-                result = getRow(getCurrentRowIndex());
-            }
+        inline Sink &append(const QString &text)
+        {
+            noteCrossReferences(text.constData(), text.size());
+            _buffer.append(text);
+            return *this;
+        }
 
-            ++_position;
-            return result;
+        // text made by the element itself (table rules, column separators, formatted timestamps),
+        // which never holds a cross-reference, so unlike append it is not scanned
+        inline Sink &appendMarkup(const QString &text)
+        {
+            _buffer.append(text);
+            return *this;
         }
 
-        bool atEnd() const override
+        inline Sink &appendMarkup(const QChar *text, int size)
         {
-            return _position == _parent->rows.count() + 4;
+            _buffer.append(text, size);
+            return *this;
         }
 
-    private:
-        const LaTeXLongTable *_parent;
-        int _position = 0;
+        inline Sink &append(QLatin1String text)
+        {
+            _buffer.append(text);
+            return *this;
+        }
 
-        const QString TableBegin = "\\begin{xltabular}[l]{\\textwidth}{%1}";
-        const QString TableLabel = "\\multicolumn{%1}{l}{\\hspace{-\\tabcolsep}%2} \\\\ \\hline";
-        const QString TableEnd = "\\end{xltabular}";
+        inline Sink &append(const QChar *text, int size)
+        {
+            noteCrossReferences(text, size);
+            _buffer.append(text, size);
+            return *this;
+        }
 
-        const QString RowStart = "    ";
-        const QString RowEnd = " \\\\ \\hline";
+        inline Sink &append(QChar c)
+        {
+            _buffer.append(c);
+            return *this;
+        }
 
-        const QString ColumnSeparator = " & ";
-        const QChar ColumnTypeSeparator = '|';
+        // plain text, LaTeX special characters are escaped (see LaTeXEscaping)
+        inline Sink &appendEscaped(const QString &text)
+        {
+            LaTeXEscaping::escape(text.constData(), text.size(), _buffer);
+            return *this;
+        }
 
-        inline QString getTableBegin() const
+        Sink &appendNumber(qint64 value)
         {
-            return TableBegin.arg(getCols());
+            QChar digits[20];
+            int position = 20;
+            quint64 magnitude = value < 0 ? 0 - quint64(value) : quint64(value);
+            do {
+                digits[--position] = QLatin1Char(char('0' + magnitude % 10));
+                magnitude /= 10;
+            } while (magnitude != 0);
+
+            if (value < 0) {
+                _buffer.append(QLatin1Char('-'));
+            }
+            _buffer.append(digits + position, 20 - position);
+            return *this;
         }
 
-        QString getCols() const
+        // same output as QString::number(value, 'f', precision) without a temporary string;
+        // values whose scaled product may round differently from the exact binary value (halfway
+        // cases such as 1.115), negative values rounding to zero and large values go through Qt
+        Sink &appendFixed(double value, int precision)
         {
-            QVector<Column> columns = _parent->_columns;
-            auto cols = QString();
-            cols.reserve(2 * columns.count() + 1);
-            cols.append(ColumnTypeSeparator);
-            for (auto c = columns.cbegin(); c != columns.cend(); ++c) {
-                cols.append(c->type);
-                cols.append(ColumnTypeSeparator);
+            static const qint64 powers[] = {1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+            if (precision < 0 || precision > 8) {
+                return append(QString::number(value, 'f', precision));
             }
 
-            return cols;
+            double product = qAbs(value) * powers[precision];
+            // the product is exact up to half an ulp, about 1.1e-16 of it
+            if (!(product < 1e15) || qAbs(product - std::floor(product) - 0.5) <= product * 4e-16) {
+                return append(QString::number(value, 'f', precision));
+            }
+
+            qint64 scaled = qRound64(product);
+            if (std::signbit(value)) {
+                if (scaled == 0) {
+                    return append(QString::number(value, 'f', precision));
+                }
+                _buffer.append(QLatin1Char('-'));
+            }
+            appendNumber(scaled / powers[precision]);
+            if (precision > 0) {
+                QChar fraction[8];
+                qint64 rest = scaled % powers[precision];
+                for (int i = precision - 1; i >= 0; --i) {
+                    fraction[i] = QLatin1Char(char('0' + rest % 10));
+                    rest /= 10;
+                }
+                _buffer.append(QLatin1Char('.'));
+                _buffer.append(fraction, precision);
+            }
+            return *this;
         }
 
-        inline QString getTableLabel() const
+        // starts a new line with the current line prefix (indentation)
+        inline void beginLine()
         {
-            return TableLabel.arg(
-                    QString::number(_parent->_columns.count()),
-                    _parent->_label)
-                .prepend(RowStart);
+            _buffer.append(_linePrefix);
         }
 
-        QString getTableHeader() const
+        inline void endLine()
         {
-            QVector<Column> columns = _parent->_columns;
-            QStringList header;
-            header.reserve(columns.count());
-            for (auto c = columns.cbegin(); c != columns.cend(); ++c) {
-                header.append(c->name);
+            _buffer.append(QLatin1Char('\n'));
+            if (_buffer.size() >= _flushThreshold) {
+                flush();
             }
-
-            return header.join(ColumnSeparator).prepend(RowStart).append(RowEnd);
         }
 
-        QString getRow(int rowIndex) const
+        void flush()
         {
-            if (_parent->rows.count() < rowIndex || rowIndex < 0) {
-                return {};
-            }
-
-            Row row = _parent->rows.at(rowIndex);
-            int columnsCount = _parent->_columns.count();
-            if (row.values.count() != columnsCount) {
-                throw std::exception();
+            if (!_buffer.isEmpty()) {
+                write(_buffer);
+                // resize keeps the allocated capacity, so the buffer is reused
+                _buffer.resize(0);
             }
+        }
 
-            QStringList rowValues(row.values);
+        inline const QString &linePrefix() const
+        {
+            return _linePrefix;
+        }
 
-            return rowValues.join(ColumnSeparator).prepend(RowStart).append(RowEnd);
+        inline void setLinePrefix(const QString &linePrefix)
+        {
+            _linePrefix = linePrefix;
         }
 
-        inline int getCurrentRowIndex() const
+        // true if any appended text used a cross-reference (e.g. LaTeXSymbols::totalPages()),
+        // such documents need a second engine pass
+        inline bool hasCrossReferences() const
         {
-            return _position - 3;
+            return _crossReferenced;
         }
 
-        inline bool allRowsReady() const
+        virtual ~Sink() = default;
+
+    protected:
+        virtual void write(const QString &buffer) = 0;
+
+    private:
+        static const int DefaultFlushThreshold = 64 * 1024;
+
+        QString _buffer;
+        QString _linePrefix;
+        int _flushThreshold;
+        bool _crossReferenced = false;
+
+        inline void noteCrossReferences(const QChar *text, int size)
         {
-            return _position == _parent->rows.count() + 3;
+            if (!_crossReferenced) {
+                _crossReferenced = LaTeXSymbols::hasCrossReference(text, size);
+            }
         }
     };
-};
 
-const QString DefaultLaTeXPreamble = "\\documentclass[a4paper, 10pt]{article}\n"
-                                     "\n"
-                                     "\\usepackage[utf8]{inputenc}\n"
-                                     "\\usepackage[T1,T2A]{fontenc}\n"
-                                     "\\usepackage[russian, english]{babel}\n"
-                                     "\\usepackage[landscape]{geometry}\n"
-                                     "\\geometry{\n"
-                                     "    a4paper,\n"
-                                     "    total={210mm,297mm},\n"
-                                     "    left=20mm,\n"
-                                     "    right=20mm,\n"
-                                     "    top=20mm,\n"
-                                     "    bottom=20mm\n"
-                                     "}\n"
-                                     "\\usepackage{indentfirst}\n"
-                                     "\\setlength{\\parindent}{0pt}\n"
-                                     "\\usepackage{lastpage}\n"
-                                     "\\usepackage{array}\n"
-                                     "\\usepackage{xltabular}\n"
-                                     "\\setlength{\\tabcolsep}{2pt}\n"
-                                     "\\newcolumntype{T}{>{\\centering\\arraybackslash}p{16.5mm}}\n"
-                                     "\\newcolumntype{S}{>{\\centering\\arraybackslash}p{5mm}}\n"
-                                     "\\newcolumntype{I}{>{\\centering\\arraybackslash}p{7.5mm}}\n"
-                                     "\\newcolumntype{L}{>{\\centering\\arraybackslash}p{11mm}}\n"
-                                     "\\newcolumntype{C}{>{\\centering\\arraybackslash}X}";
+    class IReader
+    {
+    public:
+        virtual QString readLine() = 0;
 
-class BaseDocument
+        virtual bool atEnd() const = 0;
+
+        virtual ~IReader() = default;
+    };
+
+    // pushes the element into sink, by default the lines of getReader() are appended one by one;
+    // elements should override it with a direct writer
+    virtual void writeTo(Sink &sink) const;
+
+    // lazy line reader over the element; elements written only with writeTo may return
+    // a WrittenLinesReader, which must not be combined with the default writeTo
+    virtual std::unique_ptr<IReader> getReader() const = 0;
+
+    // consecutive pieces of the element that may be compiled apart (see PdfFileRenderer::renderSplit),
+    // empty if the element can not be split; pieces refer to the element and must not outlive it
+    virtual QVector<std::shared_ptr<ITeXElement>> split() const
+    {
+        return {};
+    }
+
+    virtual ~ITeXElement() = default;
+};
+
+class TextStreamSink final: public ITeXElement::Sink
 {
 public:
-    void render(QTextStream &out) const
+    explicit TextStreamSink(QTextStream &out)
+        : _out(out)
+    {}
+
+    ~TextStreamSink() override
     {
-        out << getPreamble() << "\n\n";
-        out << DocumentBegin << "\n";
-        for (auto element = _elements.cbegin(); element != _elements.cend(); ++element) {
-            auto elementReader = element->get()->getReader();
-            while (!elementReader->atEnd()) {
-                out << LineStart << elementReader->readLine() << "\n";
-            }
-            out << "\n";
-        }
-        out << DocumentEnd << "\n";
+        flush();
     }
 
 protected:
-    explicit BaseDocument(const QVector<std::shared_ptr<ITeXElement>> &elements)
-        : _elements(elements)
-    {}
-
-    virtual QString getPreamble() const = 0;
+    void write(const QString &buffer) override
+    {
+        _out << buffer;
+    }
 
 private:
-    QVector<std::shared_ptr<ITeXElement>> _elements;
-
-    const QString LineStart = "    ";
-    const QString DocumentBegin = "\\begin{document}";
-    const QString DocumentEnd = "\\end{document}";
+    QTextStream &_out;
 };
 
-class LaTeXDocument final: public BaseDocument
+class StringSink final: public ITeXElement::Sink
 {
 public:
-    explicit LaTeXDocument(const QVector<std::shared_ptr<ITeXElement>> &elements)
-        : BaseDocument(elements), _preamble(DefaultLaTeXPreamble)
+    explicit StringSink(QString &out)
+        : Sink(1024), _out(out)
     {}
 
-    LaTeXDocument(QString preamble, const QVector<std::shared_ptr<ITeXElement>> &elements)
-        : BaseDocument(elements), _preamble(std::move(preamble))
-    {}
+    ~StringSink() override
+    {
+        flush();
+    }
 
 protected:
-    QString getPreamble() const override
+    void write(const QString &buffer) override
     {
-        return _preamble;
+        _out.append(buffer);
     }
 
 private:
-    QString _preamble;
+    QString &_out;
 };
 
-class LuaDocument final: public BaseDocument
+// encodes every flushed buffer into a reusable UTF-8 byte buffer, bypassing QTextStream and its codec
+class Utf8Sink: public ITeXElement::Sink
 {
-public:
-    struct ColumnType
+protected:
+    void write(const QString &buffer) override
     {
-        enum Alignment
-        {
-            Left,
-            Center,
-            Right
-        };
+        encode(buffer, _bytes);
+        writeBytes(_bytes.constData(), _bytes.size());
+    }
 
-        QChar name;
-        Alignment alignment;
-        // size in mm
-        uint8_t size;
-        // if is true size is ignored and will be determened by latex
-        bool autoFit;
+    virtual void writeBytes(const char *data, qint64 size) = 0;
 
-        ColumnType(const QChar &name, Alignment alignment, uint8_t size, bool autoFit)
-            : name(name), alignment(alignment), size(size), autoFit(autoFit)
-        {}
+private:
+    QByteArray _bytes;
 
-        QString asCommand() const
-        {
-            if (autoFit) {
-                return QString("\\newcolumntype{%1}{>{\\%2\\arraybackslash}X}").arg(
-                    name,
-                    getAlignmentCommand());
+    // unpaired surrogates become U+FFFD, as in QString::toUtf8
+    static void encode(const QString &text, QByteArray &bytes)
+    {
+        const ushort *source = text.utf16();
+        const int size = text.size();
+        // at most 3 bytes per UTF-16 unit, shrinking keeps the capacity for the next buffer
+        bytes.resize(3 * size);
+        char *out = bytes.data();
+        for (int i = 0; i < size; ++i) {
+            uint unit = source[i];
+            if (unit < 0x80) {
+                *out++ = char(unit);
+                continue;
             }
-            else {
-                return QString("\\newcolumntype{%1}{>{\\%2\\arraybackslash}p{%3mm}}").arg(
-                    name,
-                    getAlignmentCommand(),
-                    QString::number(size));
+            if (unit < 0x800) {
+                *out++ = char(0xC0 | (unit >> 6));
+                *out++ = char(0x80 | (unit & 0x3F));
+                continue;
             }
+            if (unit >= 0xD800 && unit <= 0xDFFF) {
+                if (unit <= 0xDBFF && i + 1 < size && source[i + 1] >= 0xDC00 && source[i + 1] <= 0xDFFF) {
+                    uint codePoint = 0x10000 + ((unit - 0xD800) << 10) + (source[++i] - 0xDC00);
+                    *out++ = char(0xF0 | (codePoint >> 18));
+                    *out++ = char(0x80 | ((codePoint >> 12) & 0x3F));
+                    *out++ = char(0x80 | ((codePoint >> 6) & 0x3F));
+                    *out++ = char(0x80 | (codePoint & 0x3F));
+                    continue;
+                }
+                unit = 0xFFFD;
+            }
+            *out++ = char(0xE0 | (unit >> 12));
+            *out++ = char(0x80 | ((unit >> 6) & 0x3F));
+            *out++ = char(0x80 | (unit & 0x3F));
         }
-    private:
-        QString getAlignmentCommand() const
-        {
-            if (alignment == Left) {
-                return "raggedleft";
+        bytes.resize(int(out - bytes.constData()));
+    }
+};
+
+// UTF-8 output into a file, on POSIX systems written straight to its descriptor;
+// the file should be opened with QIODevice::Unbuffered
+class Utf8FileSink final: public Utf8Sink
+{
+public:
+    explicit Utf8FileSink(QFile &file)
+        : _file(file)
+    {}
+
+    ~Utf8FileSink() override
+    {
+        flush();
+    }
+
+    // false if any write failed
+    inline bool written() const
+    {
+        return !_failed;
+    }
+
+protected:
+    void writeBytes(const char *data, qint64 size) override
+    {
+#ifdef Q_OS_UNIX
+        int descriptor = _file.handle();
+        while (!_failed && size > 0) {
+            ssize_t written = ::write(descriptor, data, size_t(size));
+            if (written < 0 && errno == EINTR) {
+                continue;
             }
-            else if (alignment == Center) {
-                return "centering";
+            if (written <= 0) {
+                _failed = true;
+                break;
             }
-            else if (alignment == Right) {
-                return "raggedright";
+            data += written;
+            size -= written;
+        }
+#else
+        if (!_failed && _file.write(data, size) != size) {
+            _failed = true;
+        }
+#endif
+    }
+
+private:
+    QFile &_file;
+    bool _failed = false;
+};
+
+// reads single lines produced by writers; the sink buffer and the line buffer are kept from line to line,
+// so only the returned string is allocated
+class LineReadSink final: public ITeXElement::Sink
+{
+public:
+    LineReadSink()
+        : Sink(1024)
+    {}
+
+    // the line written by writer without the line break
+    template<class Writer>
+    QString read(Writer writer)
+    {
+        writer(*this);
+        flush();
+        int size = _line.size();
+        if (size > 0 && _line.at(size - 1) == QLatin1Char('\n')) {
+            --size;
+        }
+        QString result(_line.constData(), size);
+        // not shared with result, so resize keeps the capacity
+        _line.resize(0);
+        return result;
+    }
+
+protected:
+    void write(const QString &buffer) override
+    {
+        _line.append(buffer);
+    }
+
+private:
+    QString _line;
+};
+
+// line reader over the whole output of writeTo, for elements written only with the sink API
+class WrittenLinesReader final: public ITeXElement::IReader
+{
+public:
+    explicit WrittenLinesReader(const ITeXElement *source)
+    {
+        StringSink sink(_text);
+        source->writeTo(sink);
+    }
+
+    QString readLine() override
+    {
+        if (atEnd()) {
+            return {};
+        }
+
+        int lineEnd = _text.indexOf(QLatin1Char('\n'), _position);
+        if (lineEnd < 0) {
+            lineEnd = _text.size();
+        }
+        QString result = _text.mid(_position, lineEnd - _position);
+        _position = lineEnd + 1;
+        return result;
+    }
+
+    bool atEnd() const override
+    {
+        return _position >= _text.size();
+    }
+
+private:
+    QString _text;
+    int _position = 0;
+};
+
+// drains getReader(), for elements written before the sink API
+inline void ITeXElement::writeTo(Sink &sink) const
+{
+    auto reader = getReader();
+    while (!reader->atEnd()) {
+        sink.beginLine();
+        sink.append(reader->readLine());
+        sink.endLine();
+    }
+}
+
+class LaTeXParagraph final: public ITeXElement
+{
+public:
+    QVector<QString> sentences;
+    // sentences are plain text, LaTeX special characters are escaped on output
+    bool escaped = false;
+
+    LaTeXParagraph() = default;
+
+    LaTeXParagraph(std::initializer_list<QString> sentences)
+        : sentences(sentences)
+    {}
+
+    void writeTo(Sink &sink) const override
+    {
+        for (const auto &sentence: sentences) {
+            writeSentence(sink, sentence, escaped);
+        }
+    }
+
+    std::unique_ptr<IReader> getReader() const override
+    {
+        return std::unique_ptr<Reader>(new Reader(this));
+    }
+
+private:
+    static void writeSentence(Sink &sink, const QString &sentence, bool escaped)
+    {
+        sink.beginLine();
+        if (escaped) {
+            sink.appendEscaped(sentence);
+        }
+        else {
+            sink.append(sentence);
+        }
+        sink.endLine();
+    }
+
+    class Reader final: public IReader
+    {
+    public:
+        explicit Reader(const LaTeXParagraph *source)
+            : _source(source)
+        {}
+
+        QString readLine() override
+        {
+            QString result;
+            if (!atEnd()) {
+                const QString &sentence = _source->sentences[_position];
+                bool escaped = _source->escaped;
+                result = _lines.read([&sentence, escaped](Sink &sink) { writeSentence(sink, sentence, escaped); });
             }
 
-            return "centering";
+            ++_position;
+            return result;
+        }
+
+        inline bool atEnd() const override
+        {
+            return _position == _source->sentences.count();
         }
+
+        ~Reader() override = default;
+
+    private:
+        const LaTeXParagraph *_source;
+        int _position = 0;
+        LineReadSink _lines;
     };
+};
 
-    struct Options
+// stores every distinct string once, cells refer to it by a small integer code
+class LaTeXStringDictionary
+{
+public:
+    // values are looked up as given, an escaped value is escaped (see LaTeXEscaping) once when it is added
+    quint32 intern(const QString &value, bool escaped = false)
     {
-        // possible options are 8pt, 9pt, 10pt, 11pt, 12pt, 14pt, 17pt, and 20pt
-        uint8_t fontSize = 9;
-        // margin size in mm
-        uint8_t margin = 15;
-        // column separation in mm
-        uint8_t columnSep = 2;
-        QString mainFont = "Liberation Serif";
-        QString sansFont = "Liberation Sans";
-        QString monoFont = "Liberation Mono";
+        auto &codes = escaped ? _escapedCodes : _codes;
+        auto code = codes.constFind(value);
+        if (code != codes.cend()) {
+            return code.value();
+        }
 
-        QVector<ColumnType> columnsTypes = {
-            ColumnType{'T', ColumnType::Center, 15, false},
-            ColumnType{'S', ColumnType::Center, 4, false},
-            ColumnType{'I', ColumnType::Center, 7, false},
-            ColumnType{'L', ColumnType::Center, 11, false},
-            ColumnType{'C', ColumnType::Center, 0, true},
-        };
+        auto newCode = static_cast<quint32>(_values.count());
+        _values.append(escaped ? LaTeXEscaping::escaped(value) : value);
+        codes.insert(value, newCode);
+        return newCode;
+    }
 
-        Options(uint8_t fontSize,
-                uint8_t margin,
-                uint8_t columnSep,
-                QString mainFont,
-                QString sansFont,
-                QString monoFont,
-                const QVector<ColumnType> &columnsTypes)
-            : fontSize(fontSize),
-              margin(margin),
-              columnSep(columnSep),
-              mainFont(std::move(mainFont)),
-              sansFont(std::move(sansFont)),
-              monoFont(std::move(monoFont)),
-              columnsTypes(columnsTypes)
+    inline const QString &value(quint32 code) const
+    {
+        return _values.at(static_cast<int>(code));
+    }
+
+    inline int count() const
+    {
+        return _values.count();
+    }
+
+private:
+    QHash<QString, quint32> _codes;
+    QHash<QString, quint32> _escapedCodes;
+    QVector<QString> _values;
+};
+
+// common xltabular frame (begin, label, header and end) of the table elements
+class LaTeXTableBase: public ITeXElement
+{
+public:
+    struct Column
+    {
+        Column() = default;
+
+        Column(QString name, const QChar &type)
+            : name(std::move(name)), type(type)
         {}
 
-        Options() = default;
+        Column(QString name, const QChar &type, bool dictionaryEncoded)
+            : name(std::move(name)), type(type), dictionaryEncoded(dictionaryEncoded)
+        {}
+
+        Column(QString name, const QChar &type, bool dictionaryEncoded, bool escaped)
+            : name(std::move(name)), type(type), dictionaryEncoded(dictionaryEncoded), escaped(escaped)
+        {}
+
+        QString name;
+        QChar type;
+        // values of the column are stored once in a dictionary, rows keep codes (see LaTeXLongTable::appendRow)
+        bool dictionaryEncoded = false;
+        // values are plain text, LaTeX special characters are escaped (see LaTeXEscaping);
+        // interned values are escaped once when interned
+        bool escaped = false;
     };
 
-    LuaDocument(std::initializer_list<std::shared_ptr<ITeXElement>> elements)
-        : BaseDocument(elements)
-    {}
+    inline const QString &label() const
+    {
+        return _label;
+    }
 
-    LuaDocument(const QVector<std::shared_ptr<ITeXElement>> &elements, Options options)
-        : BaseDocument(elements), options(std::move(options))
-    {}
+    inline const QVector<Column> &columns() const
+    {
+        return _columns;
+    }
 
-    Options options;
+    // splits the table into xltabular environments of at most rows rows each, so TeX never holds
+    // the whole table; the header is repeated on every page (\endhead) and at the start of every chunk,
+    // also in the middle of a page, since a chunk may begin a page; \LTpost and \LTpre are cancelled
+    // between chunks, so chunks follow each other without the skips around a table;
+    // 0 keeps the table in one environment
+    inline void setChunkRows(int rows)
+    {
+        _chunkRows = qMax(0, rows);
+    }
+
+    inline int chunkRows() const
+    {
+        return _chunkRows;
+    }
+
+    // column specs written instead of the column types, one per column; the table is written as a longtable
+    // then, which typesets every row once, while xltabular typesets the table repeatedly to fit X columns
+    // (see LaTeXLayoutPlanner); an empty list restores the column types
+    void setPlannedColumns(QStringList columns)
+    {
+        if (!columns.isEmpty() && columns.count() != _columns.count()) {
+            throw std::exception();
+        }
+        _plannedColumns = std::move(columns);
+    }
+
+    inline const QStringList &plannedColumns() const
+    {
+        return _plannedColumns;
+    }
+
+    // calls function with the text of every cell of the stored rows (rows of a generator are not visited)
+    virtual void forEachCell(const std::function<void(int column, const QString &text)> &function) const = 0;
+
+    // every chunk of a chunked table is a piece, tables with a row generator are not split
+    QVector<std::shared_ptr<ITeXElement>> split() const override
+    {
+        int rowCount = indexedRowCount();
+        if (_chunkRows == 0 || rowCount <= _chunkRows) {
+            return {};
+        }
+
+        QVector<std::shared_ptr<ITeXElement>> chunks;
+        chunks.reserve((rowCount + _chunkRows - 1) / _chunkRows);
+        for (int begin = 0; begin < rowCount; begin += _chunkRows) {
+            chunks.append(std::make_shared<Chunk>(this, begin, qMin(rowCount, begin + _chunkRows)));
+        }
+        return chunks;
+    }
 
 protected:
-    QString getPreamble() const override
+    LaTeXTableBase(QString label, QVector<Column> columns)
+        : _label(std::move(label)), _columns(std::move(columns))
+    {}
+
+    const QString RowStart = "    ";
+    const QString RowEnd = " \\\\ \\hline";
+
+    const QString ColumnSeparator = " & ";
+
+    void writeTableBegin(Sink &sink) const
     {
-        QStringList preamble
-            {
-                QString("\\documentclass[russian,openany,a4paper,%1pt,landscape]{extarticle}").arg(options.fontSize),
-                "\\usepackage[russian]{babel}",
-                QString("\\usepackage[a4paper,margin=%1mm]{geometry}").arg(options.margin),
-                "\\pagewidth=297mm",
-                "\\pageheight=210mm",
-                "\\setlength{\\parindent}{0pt}",
-                "\\usepackage{lastpage}",
-                "\\usepackage{array}",
-                "\\usepackage{xltabular}",
-                "\\usepackage{fontspec}",
-                QString("\\setlength{\\tabcolsep}{%1pt}").arg(options.columnSep),
-                QString("\\setmainfont{%1}").arg(options.mainFont),
-                QString("\\setsansfont{%1}").arg(options.sansFont),
-                QString("\\setmonofont{%1}").arg(options.monoFont)
-            };
+        QString cols;
+        cols.append(ColumnTypeSeparator);
+        if (_plannedColumns.isEmpty()) {
+            cols.reserve(2 * _columns.count() + 1);
+            for (const auto &column: _columns) {
+                cols.append(column.type);
+                cols.append(ColumnTypeSeparator);
+            }
+        }
+        else {
+            for (const auto &column: _plannedColumns) {
+                cols.append(column);
+                cols.append(ColumnTypeSeparator);
+            }
+        }
+
+        sink.beginLine();
+        sink.appendMarkup((_plannedColumns.isEmpty() ? TableBegin : PlannedTableBegin).arg(cols));
+        sink.endLine();
+    }
+
+    void writeTableLabel(Sink &sink) const
+    {
+        sink.beginLine();
+        sink.appendMarkup(RowStart);
+        sink.append(TableLabel.arg(QString::number(_columns.count()), _label));
+        sink.endLine();
+    }
+
+    // the continuation header opens a chunk or a page, so it draws its own top rule
+    void writeTableHeader(Sink &sink, bool continuation = false) const
+    {
+        sink.beginLine();
+        sink.appendMarkup(RowStart);
+        if (continuation) {
+            sink.appendMarkup(ContinuationHeaderStart);
+        }
+        for (int i = 0; i < _columns.count(); ++i) {
+            if (i > 0) {
+                sink.appendMarkup(ColumnSeparator);
+            }
+            sink.append(_columns[i].name);
+        }
+        sink.appendMarkup(RowEnd);
+        sink.endLine();
+    }
+
+    void writeHeadMark(Sink &sink, const QString &mark) const
+    {
+        sink.beginLine();
+        sink.appendMarkup(RowStart);
+        sink.appendMarkup(mark);
+        sink.endLine();
+    }
+
+    void writeTableEnd(Sink &sink) const
+    {
+        sink.beginLine();
+        sink.appendMarkup(_plannedColumns.isEmpty() ? TableEnd : PlannedTableEnd);
+        sink.endLine();
+    }
+
+    void writeTable(Sink &sink) const
+    {
+        writeTableBegin(sink);
+        writeTableLabel(sink);
+        writeTableHeader(sink);
+        if (_chunkRows > 0) {
+            writeHeadMark(sink, EndFirstHead);
+            writeTableHeader(sink, true);
+            writeHeadMark(sink, EndHead);
+        }
+        writeRows(sink);
+        writeTableEnd(sink);
+    }
+
+    void writeChunkJoin(Sink &sink) const
+    {
+        sink.beginLine();
+        sink.appendMarkup(ChunkJoin);
+        sink.endLine();
+    }
+
+    inline bool isChunkBoundary(int writtenRows) const
+    {
+        return _chunkRows > 0 && writtenRows > 0 && writtenRows % _chunkRows == 0;
+    }
+
+    // called by writeRows before every row, closes the full chunk and opens the next one
+    inline void writeChunkBreak(Sink &sink, int writtenRows) const
+    {
+        if (isChunkBoundary(writtenRows)) {
+            writeTableEnd(sink);
+            writeChunkJoin(sink);
+            writeTableBegin(sink);
+            writeTableHeader(sink, true);
+            writeHeadMark(sink, EndHead);
+        }
+    }
+
+    virtual void writeRows(Sink &sink) const = 0;
+
+    // number of rows written by writeRowAt, -1 if rows can not be accessed by index
+    virtual int indexedRowCount() const = 0;
+
+    virtual void writeRowAt(Sink &sink, int row) const = 0;
+
+    // lazy line reader over the table frame, subclasses supply the row cursor
+    class FrameReader: public IReader
+    {
+    public:
+        explicit FrameReader(const LaTeXTableBase *table)
+            : _table(table)
+        {}
+
+        QString readLine() override
+        {
+            if (atEnd()) {
+                return {};
+            }
+
+            const LaTeXTableBase *table = _table;
+            bool chunked = table->_chunkRows > 0;
+            QString result;
+            switch (_stage) {
+                case Stage::Begin:
+                    result = _lines.read([table](Sink &sink) { table->writeTableBegin(sink); });
+                    _stage = _rowsWritten == 0 ? Stage::Label : Stage::ContinuationHeader;
+                    break;
+                case Stage::Label:
+                    result = _lines.read([table](Sink &sink) { table->writeTableLabel(sink); });
+                    _stage = Stage::Header;
+                    break;
+                case Stage::Header:
+                    result = _lines.read([table](Sink &sink) { table->writeTableHeader(sink); });
+                    _stage = chunked ? Stage::FirstHeadEnd : nextRowStage();
+                    break;
+                case Stage::FirstHeadEnd:
+                    result = _lines.read([table](Sink &sink) { table->writeHeadMark(sink, table->EndFirstHead); });
+                    _stage = Stage::ContinuationHeader;
+                    break;
+                case Stage::ContinuationHeader:
+                    result = _lines.read([table](Sink &sink) { table->writeTableHeader(sink, true); });
+                    _stage = Stage::HeadEnd;
+                    break;
+                case Stage::HeadEnd:
+                    result = _lines.read([table](Sink &sink) { table->writeHeadMark(sink, table->EndHead); });
+                    _stage = nextRowStage();
+                    break;
+                case Stage::Rows:
+                    result = _lines.read([this](Sink &sink) { writeCurrentRow(sink); });
+                    _hasRow = false;
+                    ++_rowsWritten;
+                    _stage = nextRowStage();
+                    if (_stage == Stage::Rows && table->isChunkBoundary(_rowsWritten)) {
+                        _stage = Stage::ChunkEnd;
+                    }
+                    break;
+                case Stage::ChunkEnd:
+                    result = _lines.read([table](Sink &sink) { table->writeTableEnd(sink); });
+                    _stage = Stage::ChunkJoin;
+                    break;
+                case Stage::ChunkJoin:
+                    result = _lines.read([table](Sink &sink) { table->writeChunkJoin(sink); });
+                    _stage = Stage::Begin;
+                    break;
+                case Stage::End:
+                    result = _lines.read([table](Sink &sink) { table->writeTableEnd(sink); });
+                    _stage = Stage::Done;
+                    break;
+                case Stage::Done:
+                    break;
+            }
+
+            return result;
+        }
+
+        bool atEnd() const override
+        {
+            return _stage == Stage::Done;
+        }
+
+    protected:
+        // moves to the next row, looked ahead so atEnd is known before the table end is read
+        virtual bool fetchRow() = 0;
+
+        virtual void writeCurrentRow(Sink &sink) const = 0;
+
+    private:
+        enum class Stage
+        {
+            Begin,
+            Label,
+            Header,
+            FirstHeadEnd,
+            ContinuationHeader,
+            HeadEnd,
+            Rows,
+            ChunkEnd,
+            ChunkJoin,
+            End,
+            Done
+        };
+
+        const LaTeXTableBase *_table;
+        Stage _stage = Stage::Begin;
+        int _rowsWritten = 0;
+        LineReadSink _lines;
+        // fetched row is kept across the chunk break
+        bool _hasRow = false;
+
+        Stage nextRowStage()
+        {
+            if (!_hasRow) {
+                _hasRow = fetchRow();
+            }
+            return _hasRow ? Stage::Rows : Stage::End;
+        }
+    };
+
+private:
+    // rows [begin, end) of a split table, written as the same xltabular chunk as writeTable writes
+    class Chunk final: public ITeXElement
+    {
+    public:
+        Chunk(const LaTeXTableBase *table, int begin, int end)
+            : _table(table), _begin(begin), _end(end)
+        {}
+
+        void writeTo(Sink &sink) const override
+        {
+            // discarded at the top of a page when the chunk begins a part
+            if (_begin > 0) {
+                _table->writeChunkJoin(sink);
+            }
+            _table->writeTableBegin(sink);
+            if (_begin == 0) {
+                _table->writeTableLabel(sink);
+                _table->writeTableHeader(sink);
+                _table->writeHeadMark(sink, _table->EndFirstHead);
+            }
+            _table->writeTableHeader(sink, true);
+            _table->writeHeadMark(sink, _table->EndHead);
+            for (int row = _begin; row < _end; ++row) {
+                _table->writeRowAt(sink, row);
+            }
+            _table->writeTableEnd(sink);
+        }
+
+        std::unique_ptr<IReader> getReader() const override
+        {
+            return std::unique_ptr<IReader>(new WrittenLinesReader(this));
+        }
+
+    private:
+        const LaTeXTableBase *_table;
+        int _begin;
+        int _end;
+    };
+
+    QString _label;
+    QVector<Column> _columns;
+    int _chunkRows = 0;
+    QStringList _plannedColumns;
+
+    const QString TableBegin = "\\begin{xltabular}[l]{\\textwidth}{%1}";
+    const QString TableLabel = "\\multicolumn{%1}{l}{\\hspace{-\\tabcolsep}%2} \\\\ \\hline";
+    const QString TableEnd = "\\end{xltabular}";
+    // longtable is loaded by xltabular
+    const QString PlannedTableBegin = "\\begin{longtable}[l]{%1}";
+    const QString PlannedTableEnd = "\\end{longtable}";
+    const QString ContinuationHeaderStart = "\\hline ";
+    const QString EndFirstHead = "\\endfirsthead";
+    const QString EndHead = "\\endhead";
+    // cancels the skips after the closed chunk and before the next one
+    const QString ChunkJoin = "\\vskip-\\LTpost \\vskip-\\LTpre";
+
+    const QChar ColumnTypeSeparator = '|';
+};
+
+class LaTeXLongTable: public LaTeXTableBase
+{
+public:
+    struct Row
+    {
+        Row() = default;
+
+        Row(std::initializer_list<QString> values)
+            : values(values)
+        {}
+
+        // values of all columns, or only of plain columns when the row is dictionary encoded
+        QList<QString> values;
+        // dictionary codes of dictionary encoded columns in column order (see intern), empty for plain rows
+        QVector<quint32> codes;
+    };
+
+    // appends the values of all columns of the next row to row.values and returns true, returns false
+    // when rows are exhausted; generated rows are plain rows, dictionary encoded columns take the values
+    // as they are (escaped if the column is escaped); row is reused from call to call and is cleared
+    // before every call
+    using RowGenerator = std::function<bool(Row &row)>;
+
+    LaTeXLongTable(QString label, QVector<Column> columns)
+        : LaTeXTableBase(std::move(label), std::move(columns)),
+          _dictionaries(this->columns().count())
+    {}
+
+    // rows are pulled lazily from generator while the table is rendered (after rows stored in `rows`),
+    // so a streamed table is rendered once unless the generator can restart itself
+    LaTeXLongTable(QString label, QVector<Column> columns, RowGenerator generator)
+        : LaTeXTableBase(std::move(label), std::move(columns)),
+          _generator(std::move(generator)),
+          _dictionaries(this->columns().count())
+    {}
+
+    QVector<Row> rows;
+
+    // appends a row given values of all columns, values of dictionary encoded columns are interned
+    void appendRow(const QStringList &values)
+    {
+        const auto &tableColumns = columns();
+        if (values.count() != tableColumns.count()) {
+            throw std::exception();
+        }
+
+        Row row;
+        for (int i = 0; i < tableColumns.count(); ++i) {
+            if (tableColumns[i].dictionaryEncoded) {
+                row.codes.append(intern(i, values[i]));
+            }
+            else {
+                row.values.append(values[i]);
+            }
+        }
+        rows.append(row);
+    }
+
+    // code of value in the dictionary of a dictionary encoded column, for rows stored with codes;
+    // throws if the column is not dictionary encoded
+    quint32 intern(int column, const QString &value)
+    {
+        const auto &tableColumns = columns();
+        if (column < 0 || column >= tableColumns.count() || !tableColumns[column].dictionaryEncoded) {
+            throw std::exception();
+        }
+        return _dictionaries[column].intern(value, tableColumns[column].escaped);
+    }
+
+    void writeTo(Sink &sink) const override
+    {
+        writeTable(sink);
+    }
+
+    std::unique_ptr<IReader> getReader() const override
+    {
+        return std::unique_ptr<Reader>(new Reader(this));
+    }
+
+    // values of escaped plain columns are visited unescaped, interned values as interned
+    void forEachCell(const std::function<void(int column, const QString &text)> &function) const override
+    {
+        const auto &tableColumns = columns();
+        for (const auto &row: rows) {
+            bool encoded = !row.codes.isEmpty();
+            int value = 0;
+            int code = 0;
+            for (int i = 0; i < tableColumns.count(); ++i) {
+                if (encoded && tableColumns[i].dictionaryEncoded) {
+                    function(i, codedValue(i, row.codes.at(code++)));
+                }
+                else if (value < row.values.count()) {
+                    function(i, row.values.at(value++));
+                }
+            }
+        }
+    }
+
+protected:
+    void writeRows(Sink &sink) const override
+    {
+        int written = 0;
+        for (const auto &row: rows) {
+            writeChunkBreak(sink, written++);
+            writeRow(sink, row);
+        }
+        if (_generator) {
+            Row row;
+            while (generateRow(row)) {
+                writeChunkBreak(sink, written++);
+                writeRow(sink, row);
+            }
+        }
+    }
+
+    int indexedRowCount() const override
+    {
+        return _generator ? -1 : rows.count();
+    }
+
+    void writeRowAt(Sink &sink, int row) const override
+    {
+        writeRow(sink, rows.at(row));
+    }
+
+private:
+    RowGenerator _generator;
+    // one per column, used only by dictionary encoded columns
+    QVector<LaTeXStringDictionary> _dictionaries;
+
+    int _dictionaryColumnsCount = countDictionaryColumns(columns());
+
+    bool generateRow(Row &row) const
+    {
+        row.values.clear();
+        row.codes.clear();
+        return _generator(row);
+    }
+
+    // codes may be set in rows directly, so a code not given by the dictionary throws
+    inline const QString &codedValue(int column, quint32 code) const
+    {
+        const auto &dictionary = _dictionaries[column];
+        if (code >= quint32(dictionary.count())) {
+            throw std::exception();
+        }
+        return dictionary.value(code);
+    }
+
+    static int countDictionaryColumns(const QVector<Column> &columns)
+    {
+        int count = 0;
+        for (const auto &column: columns) {
+            if (column.dictionaryEncoded) {
+                ++count;
+            }
+        }
+        return count;
+    }
+
+    void writeRow(Sink &sink, const Row &row) const
+    {
+        const auto &tableColumns = columns();
+        int columnsCount = tableColumns.count();
+        bool encoded = !row.codes.isEmpty();
+        if (row.values.count() + row.codes.count() != columnsCount
+            || (encoded && row.codes.count() != _dictionaryColumnsCount)) {
+            throw std::exception();
+        }
+
+        sink.beginLine();
+        sink.appendMarkup(RowStart);
+        int value = 0;
+        int code = 0;
+        for (int i = 0; i < columnsCount; ++i) {
+            if (i > 0) {
+                sink.appendMarkup(ColumnSeparator);
+            }
+            if (encoded && tableColumns[i].dictionaryEncoded) {
+                sink.append(codedValue(i, row.codes.at(code++)));
+            }
+            else if (tableColumns[i].escaped) {
+                sink.appendEscaped(row.values.at(value++));
+            }
+            else {
+                sink.append(row.values.at(value++));
+            }
+        }
+        sink.appendMarkup(RowEnd);
+        sink.endLine();
+    }
+
+    class Reader final: public FrameReader
+    {
+    public:
+        explicit Reader(const LaTeXLongTable *parent)
+            : FrameReader(parent), _parent(parent)
+        {}
+
+    protected:
+        bool fetchRow() override
+        {
+            if (_rowIndex < _parent->rows.count()) {
+                _currentRow = &_parent->rows.at(_rowIndex++);
+                return true;
+            }
+            if (_parent->_generator && _parent->generateRow(_generatedRow)) {
+                _currentRow = &_generatedRow;
+                return true;
+            }
+
+            _currentRow = nullptr;
+            return false;
+        }
+
+        void writeCurrentRow(Sink &sink) const override
+        {
+            _parent->writeRow(sink, *_currentRow);
+        }
+
+    private:
+        const LaTeXLongTable *_parent;
+        int _rowIndex = 0;
+        // row produced by the generator, stored rows are referenced in place
+        Row _generatedRow;
+        const Row *_currentRow = nullptr;
+    };
+};
+
+// table with typed column storage, cells are formatted only while the table is rendered
+class LaTeXColumnarTable final: public LaTeXTableBase
+{
+public:
+    enum class Storage
+    {
+        Int64,
+        Double,
+        // milliseconds since epoch, rendered as yyyy-MM-dd hh:mm:ss
+        Timestamp,
+        // interned string
+        String
+    };
+
+    struct ColumnSpec
+    {
+        ColumnSpec(Column column, Storage storage, int precision = 6)
+            : column(std::move(column)), storage(storage), precision(precision)
+        {}
+
+        Column column;
+        Storage storage;
+        // digits after decimal point of Double column
+        int precision;
+    };
+
+    LaTeXColumnarTable(QString label, const QVector<ColumnSpec> &columns)
+        : LaTeXTableBase(std::move(label), headerOf(columns))
+    {
+        _data.reserve(columns.count());
+        for (const auto &column: columns) {
+            _data.append(ColumnData(column.storage, column.precision));
+        }
+    }
+
+    void reserve(int rowCount)
+    {
+        for (auto &column: _data) {
+            if (column.storage == Storage::Double) {
+                column.reals.reserve(rowCount);
+            }
+            else if (column.storage == Storage::String) {
+                column.codes.reserve(rowCount);
+            }
+            else {
+                column.integers.reserve(rowCount);
+            }
+        }
+    }
+
+    // append* throw if column does not exist or has another storage
+    inline void appendInt64(int column, qint64 value)
+    {
+        checkedColumn(column, Storage::Int64).integers.append(value);
+    }
+
+    inline void appendDouble(int column, double value)
+    {
+        checkedColumn(column, Storage::Double).reals.append(value);
+    }
+
+    inline void appendTimestamp(int column, qint64 msecsSinceEpoch)
+    {
+        checkedColumn(column, Storage::Timestamp).integers.append(msecsSinceEpoch);
+    }
+
+    inline void appendTimestamp(int column, const QDateTime &time)
+    {
+        appendTimestamp(column, time.toMSecsSinceEpoch());
+    }
+
+    inline void appendString(int column, const QString &value)
+    {
+        auto &codes = checkedColumn(column, Storage::String).codes;
+        codes.append(_strings.intern(value, columns()[column].escaped));
+    }
+
+    // number of complete rows
+    int rowCount() const
+    {
+        if (_data.isEmpty()) {
+            return 0;
+        }
+
+        int result = _data.first().count();
+        for (const auto &column: _data) {
+            result = qMin(result, column.count());
+        }
+        return result;
+    }
+
+    // fixed offset applied to all timestamps, by default each timestamp is shown in the local time zone
+    // with the offset in effect at that moment
+    inline void setTimestampUtcOffset(int seconds)
+    {
+        _timestampUtcOffset = seconds;
+        _fixedUtcOffset = true;
+    }
+
+    void writeTo(Sink &sink) const override
+    {
+        writeTable(sink);
+    }
+
+    std::unique_ptr<IReader> getReader() const override
+    {
+        return std::unique_ptr<Reader>(new Reader(this));
+    }
+
+    // cells are formatted as they are rendered
+    void forEachCell(const std::function<void(int column, const QString &text)> &function) const override
+    {
+        int count = checkedRowCount();
+        QString text;
+        StringSink sink(text);
+        for (int row = 0; row < count; ++row) {
+            for (int i = 0; i < _data.count(); ++i) {
+                writeCell(sink, _data[i], row);
+                sink.flush();
+                function(i, text);
+                // resize keeps the allocated capacity for the next cell
+                text.resize(0);
+            }
+        }
+    }
+
+protected:
+    void writeRows(Sink &sink) const override
+    {
+        int count = checkedRowCount();
+        for (int row = 0; row < count; ++row) {
+            writeChunkBreak(sink, row);
+            writeRow(sink, row);
+        }
+    }
+
+    int indexedRowCount() const override
+    {
+        return checkedRowCount();
+    }
+
+    void writeRowAt(Sink &sink, int row) const override
+    {
+        writeRow(sink, row);
+    }
+
+private:
+    struct ColumnData
+    {
+        ColumnData() = default;
+
+        ColumnData(Storage storage, int precision)
+            : storage(storage), precision(precision)
+        {}
+
+        Storage storage = Storage::String;
+        int precision = 6;
+        // Int64 and Timestamp values
+        QVector<qint64> integers;
+        QVector<double> reals;
+        QVector<quint32> codes;
+
+        int count() const
+        {
+            if (storage == Storage::Double) {
+                return reals.count();
+            }
+            else if (storage == Storage::String) {
+                return codes.count();
+            }
+
+            return integers.count();
+        }
+    };
+
+    QVector<ColumnData> _data;
+    LaTeXStringDictionary _strings;
+    int _timestampUtcOffset = 0;
+    bool _fixedUtcOffset = false;
+
+    static QVector<Column> headerOf(const QVector<ColumnSpec> &columns)
+    {
+        QVector<Column> header;
+        header.reserve(columns.count());
+        for (const auto &column: columns) {
+            header.append(column.column);
+        }
+        return header;
+    }
+
+    inline ColumnData &checkedColumn(int column, Storage storage)
+    {
+        if (column < 0 || column >= _data.count() || _data[column].storage != storage) {
+            throw std::exception();
+        }
+        return _data[column];
+    }
+
+    int checkedRowCount() const
+    {
+        int count = rowCount();
+        for (const auto &column: _data) {
+            if (column.count() != count) {
+                throw std::exception();
+            }
+        }
+        return count;
+    }
+
+    void writeRow(Sink &sink, int row) const
+    {
+        sink.beginLine();
+        sink.appendMarkup(RowStart);
+        for (int i = 0; i < _data.count(); ++i) {
+            if (i > 0) {
+                sink.appendMarkup(ColumnSeparator);
+            }
+            writeCell(sink, _data[i], row);
+        }
+        sink.appendMarkup(RowEnd);
+        sink.endLine();
+    }
+
+    void writeCell(Sink &sink, const ColumnData &column, int row) const
+    {
+        switch (column.storage) {
+            case Storage::Int64:
+                sink.appendNumber(column.integers[row]);
+                break;
+            case Storage::Double:
+                sink.appendFixed(column.reals[row], column.precision);
+                break;
+            case Storage::Timestamp:
+                writeTimestamp(sink, column.integers[row] + qint64(utcOffsetAt(column.integers[row])) * 1000);
+                break;
+            case Storage::String:
+                sink.append(_strings.value(column.codes[row]));
+                break;
+        }
+    }
+
+    inline int utcOffsetAt(qint64 msecsSinceEpoch) const
+    {
+        return _fixedUtcOffset ? _timestampUtcOffset : localUtcOffset(msecsSinceEpoch);
+    }
+
+    // offset of the local time zone at the given moment; the interval between the surrounding
+    // transitions is kept per thread, so the time zone is only consulted when a row crosses one
+    static int localUtcOffset(qint64 msecsSinceEpoch)
+    {
+        struct Interval
+        {
+            qint64 from;
+            qint64 to;
+            int offset;
+        };
+        static thread_local Interval cached = {0, 0, 0};
+
+        if (msecsSinceEpoch >= cached.from && msecsSinceEpoch < cached.to) {
+            return cached.offset;
+        }
+
+        QTimeZone zone = QTimeZone::systemTimeZone();
+        QDateTime time = QDateTime::fromMSecsSinceEpoch(msecsSinceEpoch, Qt::UTC);
+        cached.offset = zone.offsetFromUtc(time);
+        cached.from = std::numeric_limits<qint64>::min();
+        cached.to = std::numeric_limits<qint64>::max();
+        if (zone.hasTransitions()) {
+            // previousTransition is strictly before its argument, a transition at this moment counts too
+            auto previous = zone.previousTransition(time.addMSecs(1));
+            auto next = zone.nextTransition(time);
+            if (previous.atUtc.isValid()) {
+                cached.from = previous.atUtc.toMSecsSinceEpoch();
+            }
+            if (next.atUtc.isValid()) {
+                cached.to = next.atUtc.toMSecsSinceEpoch();
+            }
+        }
+        return cached.offset;
+    }
+
+    static inline qint64 floorDiv(qint64 value, qint64 divisor)
+    {
+        return value / divisor - (value % divisor < 0 ? 1 : 0);
+    }
+
+    // formats yyyy-MM-dd hh:mm:ss without QDateTime, date is computed by the civil-from-days algorithm;
+    // years outside 0-9999 do not fit four digits and are formatted by QDateTime
+    static void writeTimestamp(Sink &sink, qint64 msecsSinceEpoch)
+    {
+        qint64 secs = floorDiv(msecsSinceEpoch, 1000);
+        qint64 days = floorDiv(secs, 86400);
+        qint64 secsOfDay = secs - days * 86400;
+
+        qint64 z = days + 719468;
+        qint64 era = floorDiv(z, 146097);
+        qint64 dayOfEra = z - era * 146097;
+        qint64 yearOfEra = (dayOfEra - dayOfEra / 1460 + dayOfEra / 36524 - dayOfEra / 146096) / 365;
+        qint64 dayOfYear = dayOfEra - (365 * yearOfEra + yearOfEra / 4 - yearOfEra / 100);
+        qint64 monthIndex = (5 * dayOfYear + 2) / 153;
+        qint64 day = dayOfYear - (153 * monthIndex + 2) / 5 + 1;
+        qint64 month = monthIndex < 10 ? monthIndex + 3 : monthIndex - 9;
+        qint64 year = yearOfEra + era * 400 + (month <= 2 ? 1 : 0);
+        if (year < 0 || year > 9999) {
+            QDateTime time = QDateTime::fromMSecsSinceEpoch(msecsSinceEpoch, Qt::UTC);
+            sink.appendMarkup(time.toString("yyyy-MM-dd hh:mm:ss"));
+            return;
+        }
+
+        QChar text[19];
+        auto put = [&text](int position, qint64 value, int digits) {
+            for (int i = digits - 1; i >= 0; --i) {
+                text[position + i] = QLatin1Char(char('0' + value % 10));
+                value /= 10;
+            }
+        };
+        put(0, year, 4);
+        text[4] = QLatin1Char('-');
+        put(5, month, 2);
+        text[7] = QLatin1Char('-');
+        put(8, day, 2);
+        text[10] = QLatin1Char(' ');
+        put(11, secsOfDay / 3600, 2);
+        text[13] = QLatin1Char(':');
+        put(14, secsOfDay / 60 % 60, 2);
+        text[16] = QLatin1Char(':');
+        put(17, secsOfDay % 60, 2);
+        sink.appendMarkup(text, 19);
+    }
+
+    class Reader final: public FrameReader
+    {
+    public:
+        explicit Reader(const LaTeXColumnarTable *parent)
+            : FrameReader(parent), _parent(parent), _rowCount(parent->checkedRowCount())
+        {}
+
+    protected:
+        bool fetchRow() override
+        {
+            ++_row;
+            return _row < _rowCount;
+        }
+
+        void writeCurrentRow(Sink &sink) const override
+        {
+            _parent->writeRow(sink, _row);
+        }
+
+    private:
+        const LaTeXColumnarTable *_parent;
+        int _rowCount;
+        int _row = -1;
+    };
+};
+
+const QString DefaultLaTeXPreamble = "\\documentclass[a4paper, 10pt]{article}\n"
+                                     "\n"
+                                     "\\usepackage[utf8]{inputenc}\n"
+                                     "\\usepackage[T1,T2A]{fontenc}\n"
+                                     "\\usepackage[russian, english]{babel}\n"
+                                     "\\usepackage[landscape]{geometry}\n"
+                                     "\\geometry{\n"
+                                     "    a4paper,\n"
+                                     "    total={210mm,297mm},\n"
+                                     "    left=20mm,\n"
+                                     "    right=20mm,\n"
+                                     "    top=20mm,\n"
+                                     "    bottom=20mm\n"
+                                     "}\n"
+                                     "\\usepackage{indentfirst}\n"
+                                     "\\setlength{\\parindent}{0pt}\n"
+                                     "\\usepackage{lastpage}\n"
+                                     "\\usepackage{array}\n"
+                                     "\\usepackage{xltabular}\n"
+                                     "\\setlength{\\tabcolsep}{2pt}\n"
+                                     "\\newcolumntype{T}{>{\\centering\\arraybackslash}p{16.5mm}}\n"
+                                     "\\newcolumntype{S}{>{\\centering\\arraybackslash}p{5mm}}\n"
+                                     "\\newcolumntype{I}{>{\\centering\\arraybackslash}p{7.5mm}}\n"
+                                     "\\newcolumntype{L}{>{\\centering\\arraybackslash}p{11mm}}\n"
+                                     "\\newcolumntype{C}{>{\\centering\\arraybackslash}X}";
+
+class BaseDocument
+{
+public:
+    inline QString preamble() const
+    {
+        return getPreamble();
+    }
+
+    // stable name of a periodically regenerated document, used to reuse state of its previous render
+    inline const QString &identity() const
+    {
+        return _identity;
+    }
+
+    inline void setIdentity(const QString &identity)
+    {
+        _identity = identity;
+    }
+
+    void render(QTextStream &out) const
+    {
+        TextStreamSink sink(out);
+        render(sink);
+    }
+
+    void render(ITeXElement::Sink &sink) const
+    {
+        writeDocument(sink, _elements, {});
+    }
+
+    // the document from \begin{document} on, for an engine that has loaded the preamble already
+    void renderBody(ITeXElement::Sink &sink) const
+    {
+        writeBody(sink, _elements, {});
+    }
+
+    // elements and their pieces (see ITeXElement::split) in order, divided into at most maxParts
+    // runs of about the same number of pieces; runs are only cut between pieces of one element
+    // (e.g. between table chunks), so other elements stay on the page they would be typeset on
+    QVector<QVector<std::shared_ptr<ITeXElement>>> split(int maxParts) const
+    {
+        // every unit but the first starts at a piece that may begin a part
+        QVector<QVector<std::shared_ptr<ITeXElement>>> units(1);
+        for (const auto &element: _elements) {
+            auto elementPieces = element->split();
+            if (elementPieces.isEmpty()) {
+                units.last().append(element);
+                continue;
+            }
+            units.last().append(elementPieces.first());
+            for (int i = 1; i < elementPieces.count(); ++i) {
+                units.append({elementPieces[i]});
+            }
+        }
+
+        int partsCount = qBound(1, maxParts, units.count());
+        QVector<QVector<std::shared_ptr<ITeXElement>>> parts(partsCount);
+        for (int i = 0; i < units.count(); ++i) {
+            parts[int(qint64(i) * partsCount / units.count())].append(units[i]);
+        }
+        return parts;
+    }
+
+    // renders one run of split for a separate compilation: pages are numbered from firstPage,
+    // \pageref{LastPage} gives totalPages (if positive) and the engine log gets partPagesMarker()
+    // followed by the page count of the part; PDF objects are not compressed, so PdfConcatenator
+    // can read the output
+    void renderPart(ITeXElement::Sink &sink,
+                    const QVector<std::shared_ptr<ITeXElement>> &elements,
+                    int firstPage,
+                    int totalPages) const
+    {
+        QString setup = PartSetup.arg(QString::number(firstPage), partPagesMarker());
+        if (totalPages > 0) {
+            setup.append(PartTotalPages.arg(totalPages));
+        }
+        writeDocument(sink, elements, setup);
+    }
+
+    static inline QString partPagesMarker()
+    {
+        return "qt2tex part pages: ";
+    }
+
+protected:
+    explicit BaseDocument(const QVector<std::shared_ptr<ITeXElement>> &elements)
+        : _elements(elements)
+    {}
+
+    virtual QString getPreamble() const = 0;
+
+private:
+    QVector<std::shared_ptr<ITeXElement>> _elements;
+    QString _identity;
+
+    const QString LineStart = "    ";
+    const QString DocumentBegin = "\\begin{document}";
+    const QString DocumentEnd = "\\end{document}";
+    // after \begin{document}, so it survives a preamble dumped into a format file
+    const QString PartSetup = "\\ifdefined\\pdfvariable\\pdfvariable objcompresslevel=0 \\else\\pdfobjcompresslevel=0 \\fi\n"
+                              "\\setcounter{page}{%1}\n"
+                              "\\AtEndDocument{\\clearpage\\typeout{%2\\the\\numexpr\\value{page}-%1\\relax}}\n";
+    // label in the 5-argument form of hyperref, plain \pageref takes the second argument
+    const QString PartTotalPages = "\\expandafter\\gdef\\csname r@LastPage\\endcsname{{}{%1}{}{}{}}\n";
+
+    void writeDocument(ITeXElement::Sink &sink,
+                       const QVector<std::shared_ptr<ITeXElement>> &elements,
+                       const QString &setup) const
+    {
+        sink.append(getPreamble()).append(QLatin1String("\n\n"));
+        writeBody(sink, elements, setup);
+    }
+
+    void writeBody(ITeXElement::Sink &sink,
+                   const QVector<std::shared_ptr<ITeXElement>> &elements,
+                   const QString &setup) const
+    {
+        sink.appendMarkup(DocumentBegin).append(QLatin1Char('\n'));
+        sink.append(setup);
+
+        const QString outerPrefix = sink.linePrefix();
+        sink.setLinePrefix(outerPrefix + LineStart);
+        for (auto element = elements.cbegin(); element != elements.cend(); ++element) {
+            element->get()->writeTo(sink);
+            sink.append(QLatin1Char('\n'));
+        }
+        sink.setLinePrefix(outerPrefix);
+
+        sink.appendMarkup(DocumentEnd).append(QLatin1Char('\n'));
+        sink.flush();
+    }
+};
+
+class LaTeXDocument final: public BaseDocument
+{
+public:
+    explicit LaTeXDocument(const QVector<std::shared_ptr<ITeXElement>> &elements)
+        : BaseDocument(elements), _preamble(DefaultLaTeXPreamble)
+    {}
+
+    LaTeXDocument(QString preamble, const QVector<std::shared_ptr<ITeXElement>> &elements)
+        : BaseDocument(elements), _preamble(std::move(preamble))
+    {}
+
+protected:
+    QString getPreamble() const override
+    {
+        return _preamble;
+    }
+
+private:
+    QString _preamble;
+};
+
+class LuaDocument final: public BaseDocument
+{
+public:
+    struct ColumnType
+    {
+        enum Alignment
+        {
+            Left,
+            Center,
+            Right
+        };
+
+        QChar name;
+        Alignment alignment;
+        // size in mm
+        uint8_t size;
+        // if is true size is ignored and will be determened by latex
+        bool autoFit;
+
+        ColumnType(const QChar &name, Alignment alignment, uint8_t size, bool autoFit)
+            : name(name), alignment(alignment), size(size), autoFit(autoFit)
+        {}
+
+        QString asCommand() const
+        {
+            if (autoFit) {
+                return QString("\\newcolumntype{%1}{>{\\%2\\arraybackslash}X}").arg(
+                    name,
+                    getAlignmentCommand());
+            }
+            else {
+                return QString("\\newcolumntype{%1}{>{\\%2\\arraybackslash}p{%3mm}}").arg(
+                    name,
+                    getAlignmentCommand(),
+                    QString::number(size));
+            }
+        }
+
+        QString getAlignmentCommand() const
+        {
+            if (alignment == Left) {
+                return "raggedleft";
+            }
+            else if (alignment == Center) {
+                return "centering";
+            }
+            else if (alignment == Right) {
+                return "raggedright";
+            }
+
+            return "centering";
+        }
+    };
+
+    struct Options
+    {
+        // possible options are 8pt, 9pt, 10pt, 11pt, 12pt, 14pt, 17pt, and 20pt
+        uint8_t fontSize = 9;
+        // margin size in mm
+        uint8_t margin = 15;
+        // column separation in mm
+        uint8_t columnSep = 2;
+        QString mainFont = "Liberation Serif";
+        QString sansFont = "Liberation Sans";
+        QString monoFont = "Liberation Mono";
+
+        QVector<ColumnType> columnsTypes = {
+            ColumnType{'T', ColumnType::Center, 15, false},
+            ColumnType{'S', ColumnType::Center, 4, false},
+            ColumnType{'I', ColumnType::Center, 7, false},
+            ColumnType{'L', ColumnType::Center, 11, false},
+            ColumnType{'C', ColumnType::Center, 0, true},
+        };
+
+        Options(uint8_t fontSize,
+                uint8_t margin,
+                uint8_t columnSep,
+                QString mainFont,
+                QString sansFont,
+                QString monoFont,
+                const QVector<ColumnType> &columnsTypes)
+            : fontSize(fontSize),
+              margin(margin),
+              columnSep(columnSep),
+              mainFont(std::move(mainFont)),
+              sansFont(std::move(sansFont)),
+              monoFont(std::move(monoFont)),
+              columnsTypes(columnsTypes)
+        {}
+
+        Options() = default;
+    };
+
+    LuaDocument(std::initializer_list<std::shared_ptr<ITeXElement>> elements)
+        : BaseDocument(elements)
+    {}
+
+    LuaDocument(const QVector<std::shared_ptr<ITeXElement>> &elements, Options options)
+        : BaseDocument(elements), options(std::move(options))
+    {}
+
+    Options options;
+
+protected:
+    QString getPreamble() const override
+    {
+        QStringList preamble
+            {
+                QString("\\documentclass[russian,openany,a4paper,%1pt,landscape]{extarticle}").arg(options.fontSize),
+                "\\usepackage[russian]{babel}",
+                QString("\\usepackage[a4paper,margin=%1mm]{geometry}").arg(options.margin),
+                "\\pagewidth=297mm",
+                "\\pageheight=210mm",
+                "\\setlength{\\parindent}{0pt}",
+                "\\usepackage{lastpage}",
+                "\\usepackage{array}",
+                "\\usepackage{xltabular}",
+                "\\usepackage{fontspec}",
+                QString("\\setlength{\\tabcolsep}{%1pt}").arg(options.columnSep),
+                QString("\\setmainfont{%1}").arg(options.mainFont),
+                QString("\\setsansfont{%1}").arg(options.sansFont),
+                QString("\\setmonofont{%1}").arg(options.monoFont)
+            };
+
+        for (auto const &columnType: options.columnsTypes) {
+            preamble.append(columnType.asCommand());
+        }
+
+        return preamble.join('\n');
+    }
+};
+
+// plans fixed widths of the X columns of a table from its content (the widest and the 90th percentile
+// cell of every column), so the table is written as a longtable of p columns and TeX skips the trial
+// typesetting of xltabular; the planned widths share what the other columns leave of \textwidth,
+// so the table fills the line as with X columns
+class LaTeXLayoutPlanner
+{
+public:
+    // column type of the preamble
+    struct ColumnType
+    {
+        ColumnType(const QChar &name, QString alignment, double widthMm)
+            : name(name), alignment(std::move(alignment)), widthMm(widthMm)
+        {}
+
+        explicit ColumnType(const LuaDocument::ColumnType &type)
+            : name(type.name), alignment(type.getAlignmentCommand()), widthMm(type.autoFit ? 0 : type.size)
+        {}
+
+        ColumnType() = default;
+
+        QChar name;
+        // paragraph alignment command of the cells, without the backslash
+        QString alignment = "centering";
+        // width of a p column, 0 for an X column, which is planned
+        double widthMm = 0;
+    };
+
+    // width of a cell text set in one line, in mm
+    using Measure = std::function<double(const QString &text)>;
+
+    LaTeXLayoutPlanner(double textWidthMm, double fontSizePt, double columnSepPt, QVector<ColumnType> types)
+        : _textWidthMm(textWidthMm),
+          _columnSepMm(columnSepPt * mmPerPt()),
+          _types(std::move(types)),
+          _measure(averageCharMeasure(fontSizePt))
+    {}
+
+    // column types and page of DefaultLaTeXPreamble
+    static LaTeXLayoutPlanner forLaTeXDocument()
+    {
+        return LaTeXLayoutPlanner(
+            257,
+            10,
+            2,
+            {
+                {'T', "centering", 16.5},
+                {'S', "centering", 5},
+                {'I', "centering", 7.5},
+                {'L', "centering", 11},
+                {'C', "centering", 0}
+            });
+    }
+
+    static LaTeXLayoutPlanner forLuaDocument(const LuaDocument::Options &options)
+    {
+        QVector<ColumnType> types;
+        for (const auto &type: options.columnsTypes) {
+            types.append(ColumnType(type));
+        }
+        return LaTeXLayoutPlanner(297 - 2 * options.margin, options.fontSize, options.columnSep, types);
+    }
+
+    // by default a text is half of the font size wide per typeset character (see typesetText);
+    // measure is given cell texts as they are, markup included
+    void setMeasure(Measure measure)
+    {
+        _measure = std::move(measure);
+    }
+
+    // cell texts are measured by their typeset characters (see typesetText) with the metrics of the table
+    // font, e.g. TfmMetrics::find("larm1000", ...) for DefaultLaTeXPreamble or
+    // OpenTypeMetrics::find(options.mainFont, ...) for LuaDocument; nullptr keeps the measure
+    void setFontMetrics(std::shared_ptr<const FontMetrics> font)
+    {
+        if (font) {
+            _measure = [font](const QString &text) {
+                return font->widthMm(typesetText(text));
+            };
+        }
+    }
+
+    // characters a cell text typesets: the escapes of LaTeXEscaping give their character back, ~ is a space,
+    // other commands and braces are dropped (the text of their arguments is kept); text itself (shared,
+    // not copied) if it has no markup
+    static QString typesetText(const QString &text)
+    {
+        const QChar *units = text.constData();
+        const int size = text.size();
+        int i = LaTeXEscaping::findSpecial(units, 0, size);
+        if (i == size) {
+            return text;
+        }
+
+        QString result;
+        result.reserve(size);
+        result.append(units, i);
+        while (i < size) {
+            const QChar c = units[i++];
+            if (c == QLatin1Char('~')) {
+                result.append(QLatin1Char(' '));
+            }
+            else if (c == QLatin1Char('{') || c == QLatin1Char('}')) {
+                continue;
+            }
+            else if (c != QLatin1Char('\\')) {
+                result.append(c);
+            }
+            else if (i < size && !isCommandLetter(units[i])) {
+                // \\ breaks the line, \& and the like typeset the character
+                result.append(units[i] == QLatin1Char('\\') ? QChar(QLatin1Char(' ')) : units[i]);
+                ++i;
+            }
+            else {
+                const int nameStart = i;
+                while (i < size && isCommandLetter(units[i])) {
+                    ++i;
+                }
+                const QStringRef name(&text, nameStart, i - nameStart);
+                if (name == QLatin1String("textbackslash")) {
+                    result.append(QLatin1Char('\\'));
+                }
+                else if (name == QLatin1String("textasciitilde")) {
+                    result.append(QLatin1Char('~'));
+                }
+                else if (name == QLatin1String("textasciicircum")) {
+                    result.append(QLatin1Char('^'));
+                }
+                // a space after a command name only ends the name
+                if (i < size && units[i] == QLatin1Char(' ')) {
+                    ++i;
+                }
+            }
+        }
+        return result;
+    }
+
+    // sets the planned columns of table, returns false and leaves the table as it is if the table has
+    // a column type unknown to the planner or the fixed columns leave too little room
+    bool plan(LaTeXTableBase &table) const
+    {
+        const auto &columns = table.columns();
+        const int count = columns.count();
+        if (count == 0) {
+            return false;
+        }
+
+        QVector<const ColumnType *> types(count, nullptr);
+        double fixedMm = 0;
+        QVector<int> planned;
+        for (int i = 0; i < count; ++i) {
+            for (const auto &type: _types) {
+                if (type.name == columns[i].type) {
+                    types[i] = &type;
+                }
+            }
+            if (types[i] == nullptr) {
+                return false;
+            }
+            if (types[i]->widthMm > 0) {
+                fixedMm += types[i]->widthMm;
+            }
+            else {
+                planned.append(i);
+            }
+        }
+
+        double availableMm = _textWidthMm - fixedMm - 2 * count * _columnSepMm - (count + 1) * RuleMm;
+        if (availableMm < planned.count() * MinColumnMm) {
+            return false;
+        }
+
+        std::vector<std::vector<double>> cells(count);
+        if (!planned.isEmpty()) {
+            table.forEachCell([this, &types, &cells](int column, const QString &text) {
+                if (types[column]->widthMm <= 0) {
+                    cells[column].push_back(_measure(text));
+                }
+            });
+        }
+
+        // a column is not planned narrower than the longest word of its header
+        QVector<double> maxMm;
+        QVector<double> percentileMm;
+        for (int column: planned) {
+            auto &widths = cells[column];
+            std::sort(widths.begin(), widths.end());
+            double minimum = std::max(MinColumnMm, longestWordMm(columns[column].name));
+            if (widths.empty()) {
+                maxMm.append(minimum);
+                percentileMm.append(minimum);
+            }
+            else {
+                maxMm.append(std::max(minimum, widths.back()));
+                percentileMm.append(std::max(minimum, widths[size_t(double(widths.size() - 1) * Percentile)]));
+            }
+        }
+        const QVector<double> plannedMm = distribute(maxMm, percentileMm, availableMm);
+        double plannedSum = 0;
+        for (double width: plannedMm) {
+            plannedSum += width;
+        }
+
+        QStringList specs;
+        int next = 0;
+        for (int i = 0; i < count; ++i) {
+            if (types[i]->widthMm > 0) {
+                specs.append(QString(columns[i].type));
+                continue;
+            }
+            // rounded down, so rounding never makes the table wider than the line
+            double share = std::floor(plannedMm[next++] / plannedSum * 10000) / 10000;
+            specs.append(PlannedColumn.arg(
+                types[i]->alignment,
+                QString::number(share, 'f', 4),
+                QString::number(fixedMm, 'f', 2),
+                QString::number(2 * count),
+                QString::number(count + 1)));
+        }
+        table.setPlannedColumns(specs);
+        return true;
+    }
+
+private:
+    double _textWidthMm;
+    double _columnSepMm;
+    QVector<ColumnType> _types;
+    Measure _measure;
+
+    const double MinColumnMm = 5;
+    const double RuleMm = 0.4 * mmPerPt();
+    const double Percentile = 0.9;
+    // share of the width left by the fixed columns, the tabcolseps and the rules of the table
+    const QString PlannedColumn = ">{\\%1\\arraybackslash}p{%2\\dimexpr\\textwidth-%3mm-%4\\tabcolsep-%5\\arrayrulewidth\\relax}";
+
+    static inline double mmPerPt()
+    {
+        return 25.4 / 72.27;
+    }
+
+    static Measure averageCharMeasure(double fontSizePt)
+    {
+        const double charMm = fontSizePt * mmPerPt() / 2;
+        return [charMm](const QString &text) {
+            return typesetText(text).size() * charMm;
+        };
+    }
+
+    static inline bool isCommandLetter(const QChar c)
+    {
+        return (c >= QLatin1Char('a') && c <= QLatin1Char('z')) || (c >= QLatin1Char('A') && c <= QLatin1Char('Z'));
+    }
+
+    double longestWordMm(const QString &text) const
+    {
+        double longest = 0;
+        for (const auto &word: text.split(QLatin1Char(' '))) {
+            longest = std::max(longest, _measure(word));
+        }
+        return longest;
+    }
+
+    // widths filling availableMm: the widest cells if they fit, otherwise the 90th percentile cells with
+    // the rest given to the columns by how much they still wrap, otherwise the 90th percentile cells
+    // scaled down
+    static QVector<double> distribute(const QVector<double> &maxMm,
+                                      const QVector<double> &percentileMm,
+                                      double availableMm)
+    {
+        double maxSum = 0;
+        double percentileSum = 0;
+        for (int i = 0; i < maxMm.count(); ++i) {
+            maxSum += maxMm[i];
+            percentileSum += percentileMm[i];
+        }
+
+        QVector<double> widths;
+        widths.reserve(maxMm.count());
+        for (int i = 0; i < maxMm.count(); ++i) {
+            if (maxSum <= availableMm) {
+                widths.append(maxMm[i] * availableMm / maxSum);
+            }
+            else if (percentileSum <= availableMm) {
+                widths.append(percentileMm[i]
+                                  + (availableMm - percentileSum) * (maxMm[i] - percentileMm[i])
+                                      / (maxSum - percentileSum));
+            }
+            else {
+                widths.append(percentileMm[i] * availableMm / percentileSum);
+            }
+        }
+        return widths;
+    }
+};
+
+bool render_pdf(const QFileInfo &outputFile, const LaTeXDocument &document, QObject *parent = nullptr)
+{
+    const QString command = "pdflatex";
+
+    QTemporaryDir tmp;
+    if (!tmp.isValid()) {
+        return false;
+    }
+
+    QString tmpTexFilePath = tmp.filePath("main.tex");
+    QFile tmpTexFile(tmpTexFilePath, parent);
+    if (!tmpTexFile.open(QIODevice::WriteOnly)) {
+        return false;
+    }
+
+    QTextStream tmpTexStream(&tmpTexFile);
+    document.render(tmpTexStream);
+    tmpTexFile.close();
+
+    // launch pdflatex 2 times (1st for calculate total size of document)
+    auto outDirParam = QString("-output-directory=%1").arg(tmp.path());
+
+    QProcess firstPass(parent);
+    firstPass.start(
+        command,
+        {
+            "-draftmode",
+            outDirParam,
+            tmpTexFilePath
+        });
+
+    if (!firstPass.waitForFinished()) {
+        return false;
+    }
+
+    QProcess secondPass(parent);
+    secondPass.start(
+        command,
+        {
+            outDirParam,
+            tmpTexFilePath
+        });
+
+    if (!secondPass.waitForFinished()) {
+        return false;
+    }
+
+    if (outputFile.exists()) {
+        QFile(outputFile.filePath()).remove();
+    }
+
+    return QFile::copy(
+        tmp.filePath("main.pdf"),
+        outputFile.filePath());
+}
+
+bool render_pdf(const QString &outputFilePath, const LaTeXDocument &document, QObject *parent = nullptr)
+{
+    return render_pdf(
+        QFileInfo(outputFilePath),
+        document,
+        parent);
+}
+
+class FileRenderer
+{
+public:
+    virtual bool render(const QFileInfo &output, const BaseDocument &document) = 0;
+
+    bool render(const QString &outputPath, const BaseDocument &document)
+    {
+        return render(QFileInfo(outputPath), document);
+    }
+};
+
+class TeXFileRenderer final: public FileRenderer
+{
+public:
+    explicit TeXFileRenderer(QObject *parent = nullptr)
+        : _parent(parent)
+    {}
+
+    using FileRenderer::render;
+
+    bool render(const QFileInfo &output, const BaseDocument &document) override
+    {
+        QFile outputFile(output.filePath(), _parent);
+        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered)) {
+            return false;
+        }
+        bool written = false;
+        {
+            Utf8FileSink sink(outputFile);
+            document.render(sink);
+            _hasCrossReferences = sink.hasCrossReferences();
+            written = sink.written();
+        }
+        outputFile.close();
+
+        return written;
+    }
+
+    // whether the last rendered document needs more than one engine pass
+    inline bool hasCrossReferences() const
+    {
+        return _hasCrossReferences;
+    }
+
+private:
+    QObject *_parent = nullptr;
+    bool _hasCrossReferences = false;
+};
+
+// Renders documents by engine passes in one of these backends:
+//   cold      main.tex written whole, then the passes of a PassPlan (render, renderBatch, renderAsync)
+//   warm      body fed to engines that have loaded the preamble ahead (render with setWarmWorkers)
+//   streamed  first pass reads a FIFO while the TeX is generated (render and renderBatch with
+//             setStreamedFirstPass)
+//   split     parts compiled concurrently and concatenated (renderSplit)
+// render takes warm if set, then streamed if set, then cold; renderBatch never uses warm workers;
+// renderAsync is always cold, its passes chained in the event loop.
+// Settings and the backends that use them:
+//                     cold  async  warm  streamed  split
+//   format cache       yes   yes    no    yes       yes
+//   .aux cache         yes   yes    yes   yes       no
+//   PDF cache          yes   yes    no    no        no
+//   coalescing         yes   no     no    no        no
+//   convergence        yes   yes    yes   yes       yes
+//   launcher           yes   no     no    later     yes
+//   log policy         yes   yes    no    later     yes
+// "later" applies to the passes after the first one; warm workers and the streamed first pass are
+// QProcesses whose terminal output is discarded. A warm render that fails falls back to cold passes,
+// which use the launcher and the log policy. Settings that change the same backend in contradicting
+// ways are rejected by their setters (see setWarmWorkers, setStreamedFirstPass, setCoalescedRenders)
+class PdfFileRenderer: public FileRenderer
+{
+public:
+    struct CommandDescription
+    {
+        QString name;
+        QStringList args;
+
+        CommandDescription(const QString &name, const QStringList &args)
+            : name(name), args(args)
+        {}
+
+        CommandDescription() = default;
+    };
+
+    enum class Pipeline
+    {
+        // all commands
+        Full,
+        // single pass commands, used when the document has no cross-references
+        SinglePass,
+        // final command repeated until cross-references are stable (see setConvergence)
+        Converged,
+        // final command over .aux of the previous render of the same document, repeated if it was stale
+        // (see setAuxCacheDir)
+        Seeded,
+        // body fed to engine processes that have loaded the preamble ahead (see setWarmWorkers)
+        Warm,
+        // final command reads the TeX through a FIFO while it is generated (see setStreamedFirstPass)
+        Streamed,
+        // pieces compiled concurrently and concatenated (see renderSplit)
+        Split,
+        // PDF delivered from the PDF cache without an engine pass (see setPdfCacheDir)
+        Cached,
+        // PDF of a concurrent render of the same TeX (see setCoalescedRenders)
+        Coalesced
+    };
+
+    // what happens to the terminal output of engine processes (the engine writes its own .log anyway)
+    enum class LogPolicy
+    {
+        // not read; engines are started with -interaction=batchmode, so they write next to nothing
+        Discard,
+        // the last tailKBytes of every process are kept for RenderReport::logTail
+        Tail,
+        // written to a file, by default next to the output PDF with .log appended, report.pdf gives report.pdf.log
+        // (report.pdf-1.log, report.pdf-2.log and so on for the parts of renderSplit), see setLogPath;
+        // the file is emptied as a render starts and holds its passes;
+        // warm workers and the streamed first pass discard their output whatever the policy
+        File
+    };
+
+    // what a render did and where its time went
+    struct RenderReport
+    {
+        struct Phase
+        {
+            Phase(QString name, qint64 wallNSecs)
+                : name(std::move(name)), wallNSecs(wallNSecs)
+            {}
+
+            Phase() = default;
+
+            QString name;
+            qint64 wallNSecs = 0;
+        };
+
+        // one engine process; CPU time and peak RSS are those of the process as wait4 gives them, so they
+        // are known only for processes started by Launcher::PosixSpawn (QProcess reaps its children itself),
+        // -1 where not known
+        struct Command
+        {
+            QString name;
+            QStringList arguments;
+            bool success = false;
+            qint64 wallNSecs = 0;
+            qint64 userCpuUSecs = -1;
+            qint64 systemCpuUSecs = -1;
+            qint64 maxRssKBytes = -1;
+        };
+
+        bool success = false;
+        Pipeline pipeline = Pipeline::Full;
+        int passCount = 0;
+        qint64 wallNSecs = 0;
+        // size of the generated TeX, -1 if not known
+        qint64 texBytes = -1;
+        // from the engine log of the final pass, -1 if not known
+        int pageCount = -1;
+        // terminal output tail of the last engine process (of the failed one for split renders)
+        // with LogPolicy::Tail, warm and streamed passes discard their terminal output
+        QByteArray logTail;
+        // in the order they ran: tex (TeX generation), cache (PDF cache lookup), format (format files),
+        // coalesce (wait for a concurrent render of the same TeX), finish (.aux and PDF caches and move
+        // of the PDF); split renders have format, first_pass, final_pass and concatenate
+        QVector<Phase> phases;
+        QVector<Command> commands;
+    };
+
+    using ReportCallback = std::function<void(const RenderReport &report)>;
+    using LogPath = std::function<QString(const QFileInfo &output)>;
+
+    // how engine processes are started
+    enum class Launcher
+    {
+        // QProcess, which forks the calling process
+        QtProcess,
+        // posix_spawnp, which glibc runs with vfork semantics (CLONE_VM), so the page tables of
+        // a process holding a lot of memory are not copied for every pass
+        PosixSpawn
+    };
+
+    PdfFileRenderer(QObject *parent, int timeoutMSecs, const QVector<CommandDescription> &commands)
+        : _parent(parent), _timeoutMSecs(timeoutMSecs), _commands(commands)
+    {}
+
+    PdfFileRenderer(QObject *parent,
+                    int timeoutMSecs,
+                    const QVector<CommandDescription> &commands,
+                    const QVector<CommandDescription> &singlePassCommands)
+        : _parent(parent), _timeoutMSecs(timeoutMSecs), _commands(commands), _singlePassCommands(singlePassCommands)
+    {}
+
+    PdfFileRenderer(std::initializer_list<CommandDescription> commands)
+        : _parent(nullptr), _timeoutMSecs(50000), _commands(commands)
+    {}
+
+    PdfFileRenderer(std::initializer_list<CommandDescription> commands,
+                    std::initializer_list<CommandDescription> singlePassCommands)
+        : _parent(nullptr), _timeoutMSecs(50000), _commands(commands), _singlePassCommands(singlePassCommands)
+    {}
+
+    using FileRenderer::render;
+
+    // preambles are dumped into format files (mylatexformat) stored in dir and reused by later renders,
+    // formats are keyed by the engine version so an upgrade dumps them again; a failed dump is retried
+    // after an hour; empty dir disables the format cache
+    void setFormatCacheDir(const QString &dir)
+    {
+        _formatCacheDir = dir;
+    }
+
+    inline const QString &formatCacheDir() const
+    {
+        return _formatCacheDir;
+    }
+
+    // instead of the fixed command list, documents with cross-references are rendered by repeating
+    // the final command until the .aux file and the log say that the output is stable,
+    // at most maxPasses times; 0 restores the fixed command list
+    void setConvergence(int maxPasses)
+    {
+        _maxConvergencePasses = qMax(0, maxPasses);
+    }
+
+    inline int maxConvergencePasses() const
+    {
+        return _maxConvergencePasses;
+    }
+
+    // .aux of every successful render is kept in dir keyed by the document identity (the output path
+    // if the document has none), the next render of the document starts from it, so usually one pass
+    // gives the final PDF and a second pass is made only if the page count or other labels changed;
+    // empty dir disables the .aux cache
+    void setAuxCacheDir(const QString &dir)
+    {
+        _auxCacheDir = dir;
+    }
+
+    inline const QString &auxCacheDir() const
+    {
+        return _auxCacheDir;
+    }
+
+    // PDFs of successful renders are kept in dir keyed by the generated TeX, the command lists and the
+    // versions of the engines; a render that generates the same TeX gets the cached PDF as a reflink
+    // (a copy-on-write clone) or a copy without starting an engine, so rewriting the output never changes
+    // the cache. The least recently used PDFs are removed when the cache grows over maxBytes.
+    // TeX that uses the time of the render (\today, \time, \year and the like) is not cached, other
+    // inputs the key does not see (files read by \input or \includegraphics, the PDF creation date)
+    // are served as they were when the PDF was cached. Consulted by the pipelines that write the whole
+    // TeX before the first pass, so not by warm workers, the streamed first pass and renderSplit;
+    // empty dir disables the PDF cache
+    void setPdfCacheDir(const QString &dir, qint64 maxBytes = DefaultPdfCacheBytes)
+    {
+        _pdfCacheDir = dir;
+        _pdfCacheMaxBytes = qMax<qint64>(0, maxBytes);
+    }
+
+    inline const QString &pdfCacheDir() const
+    {
+        return _pdfCacheDir;
+    }
+
+    inline qint64 pdfCacheMaxBytes() const
+    {
+        return _pdfCacheMaxBytes;
+    }
+
+    // launcher of the engine passes of render, renderBatch and renderSplit and of format dumps, with the same
+    // timeout and exit code checks; warm workers, the streamed first pass and renderAsync use QProcess.
+    // Launcher::PosixSpawn needs a POSIX system, QProcess is used elsewhere
+    void setLauncher(Launcher launcher)
+    {
+        _launcher = launcher;
+    }
+
+    inline Launcher launcher() const
+    {
+        return _launcher;
+    }
+
+    // concurrent render and renderBatch calls of any renderers in the process that generate the same TeX
+    // for the same commands share one compilation: the first one runs the engine, the others wait for it
+    // (at most the timeout of the renderer) and get a copy of its PDF, made for them before the first
+    // render returns, as a reflink or a copy. Warm workers, the streamed first pass,
+    // renderSplit and renderAsync render alone; throws if the streamed first pass is set, since then
+    // render and renderBatch never coalesce
+    void setCoalescedRenders(bool coalesced)
+    {
+        if (coalesced && _streamedFirstPass) {
+            throw std::exception();
+        }
+        _coalescedRenders = coalesced;
+    }
+
+    inline bool coalescedRenders() const
+    {
+        return _coalescedRenders;
+    }
+
+    // render keeps count engine processes (the last command) started ahead with the preamble of the last
+    // rendered document loaded and waiting for the body on stdin, so a render skips the engine startup
+    // and the preamble; a document with cross-references takes one worker per pass until converged.
+    // Every worker renders one document and is replaced by a new one at once. Workers live in the thread
+    // of render and serve only render, batch, split and async renders start their own processes;
+    // 0 stops the workers; throws if the streamed first pass is set, both replace the first pass of render
+    void setWarmWorkers(int count)
+    {
+        if (count > 0 && _streamedFirstPass) {
+            throw std::exception();
+        }
+        _warmWorkersCount = qMax(0, count);
+        if (_warmWorkersCount == 0) {
+            _warmWorkers.workers.reset();
+        }
+    }
+
+    inline int warmWorkers() const
+    {
+        return _warmWorkersCount;
+    }
+
+    // the first pass of render and renderBatch reads the document through a FIFO while it is generated,
+    // so typesetting overlaps generation; the stream is also written to main.tex, which later passes of
+    // a document with cross-references read until converged. Needs a POSIX system, ignored elsewhere;
+    // throws if warm workers or coalesced renders are set (see setWarmWorkers, setCoalescedRenders)
+    void setStreamedFirstPass(bool streamed)
+    {
+        if (streamed && (_warmWorkersCount > 0 || _coalescedRenders)) {
+            throw std::exception();
+        }
+        _streamedFirstPass = streamed;
+    }
+
+    inline bool streamedFirstPass() const
+    {
+        return _streamedFirstPass;
+    }
+
+    // terminal output of the engine processes is discarded, kept as a tail of tailKBytes or streamed to
+    // a file, see LogPolicy; the last 64 KB are kept by default
+    void setLogPolicy(LogPolicy policy, int tailKBytes = DefaultLogTailKBytes)
+    {
+        _logPolicy = policy;
+        _logTailKBytes = qMax(0, tailKBytes);
+    }
+
+    inline LogPolicy logPolicy() const
+    {
+        return _logPolicy;
+    }
+
+    inline int logTailKBytes() const
+    {
+        return _logTailKBytes;
+    }
+
+    // gives the LogPolicy::File log of a render to output, an empty path for none; called as every render,
+    // renderSplit, renderAsync and renderBatch job starts (the latter from the batch threads), so it must
+    // give concurrent jobs different paths. Unset, the log is the output path with .log appended, which
+    // neither takes the engine log of a TeX file beside the output nor collides between different outputs
+    void setLogPath(LogPath logPath)
+    {
+        _logPath = std::move(logPath);
+    }
+
+    // called with the report of every render, renderSplit and renderAsync, and of every renderBatch job
+    // (from the batch threads), e.g. to export the timings to a metrics system
+    void setReportCallback(ReportCallback callback)
+    {
+        _reportCallback = std::move(callback);
+    }
+
+    // report of the last render
+    inline const RenderReport &lastReport() const
+    {
+        return _lastReport;
+    }
+
+    // pipeline chosen by the last render
+    inline Pipeline lastPipeline() const
+    {
+        return _lastPipeline;
+    }
+
+    // number of engine passes made by the last render
+    inline int lastPassCount() const
+    {
+        return _lastPassCount;
+    }
+
+    bool render(const QFileInfo &output, const BaseDocument &document) override final
+    {
+        QElapsedTimer timer;
+        timer.start();
+        RenderState state(_parent);
+        state.logFile = logFile(output);
+        bool rendered = _warmWorkersCount > 0 && !_commands.isEmpty()
+            ? renderWarm(output, document, state)
+            : renderDocument(output, document, state);
+        completeReport(state, rendered, timer);
+        _lastPipeline = state.pipeline;
+        _lastPassCount = state.passCount;
+        _lastReport = state.report;
+        return rendered;
+    }
+
+    struct BatchJob
+    {
+        BatchJob(const QFileInfo &output, const BaseDocument &document)
+            : output(output), document(&document)
+        {}
+
+        BatchJob(const QString &outputPath, const BaseDocument &document)
+            : output(outputPath), document(&document)
+        {}
+
+        BatchJob() = default;
+
+        QFileInfo output;
+        // must outlive renderBatch, elements shared by several jobs are read concurrently
+        const BaseDocument *document = nullptr;
+    };
+
+    struct BatchResult
+    {
+        QFileInfo output;
+        bool success = false;
+        Pipeline pipeline = Pipeline::Full;
+        int passCount = 0;
+        RenderReport report;
+    };
+
+    // renders jobs on up to maxConcurrency threads, each job in its own temporary dir;
+    // results are in the order of jobs
+    QVector<BatchResult> renderBatch(const QVector<BatchJob> &jobs, int maxConcurrency = QThread::idealThreadCount()) const
+    {
+        QVector<BatchResult> results(jobs.count());
+        forEachConcurrently(jobs.count(), maxConcurrency, [this, &jobs, &results](int job) {
+            // QProcess and QFile can not have a parent living in another thread
+            QElapsedTimer timer;
+            timer.start();
+            RenderState state(nullptr);
+            BatchResult &result = results[job];
+            result.output = jobs[job].output;
+            state.logFile = logFile(result.output);
+            try {
+                result.success = jobs[job].document != nullptr
+                    && renderDocument(jobs[job].output, *jobs[job].document, state);
+            }
+            catch (...) {
+                result.success = false;
+            }
+            completeReport(state, result.success, timer);
+            result.pipeline = state.pipeline;
+            result.passCount = state.passCount;
+            result.report = state.report;
+        });
+
+        return results;
+    }
+
+    // renders a large document as up to maxParts pieces compiled at once, each in its own temporary dir,
+    // and joins their PDFs by PdfConcatenator; the document is split only between chunks of chunked tables
+    // (see BaseDocument::split), every part starts a new page, so a document without chunked tables
+    // is rendered as by render.
+    // The first command counts the pages of every piece, then the last command renders the pieces
+    // with their first page number and the total page count until the page counts and the .aux of
+    // pieces with cross-references settle, so page numbers, \pageref{LastPage} and \pageref to labels
+    // of the same piece are those of the whole document; references between pieces are not resolved.
+    // A document that can not be split is rendered as by render
+    bool renderSplit(const QFileInfo &output, const BaseDocument &document, int maxParts = QThread::idealThreadCount()) const
+    {
+        QElapsedTimer timer;
+        timer.start();
+        RenderState state(_parent);
+        state.logFile = logFile(output);
+        bool rendered = renderDocumentSplit(output, document, maxParts, state);
+        completeReport(state, rendered, timer);
+        return rendered;
+    }
+
+    bool renderSplit(const QString &outputPath, const BaseDocument &document, int maxParts = QThread::idealThreadCount()) const
+    {
+        return renderSplit(QFileInfo(outputPath), document, maxParts);
+    }
+
+    // renders without blocking: TeX is written (and a format dumped) in a thread of its own, then engine
+    // passes are chained through QProcess::finished in the event loop of the calling thread, which must
+    // be running; the renderer and the document must outlive the returned future
+    QFuture<bool> renderAsync(const QFileInfo &output, const BaseDocument &document) const
+    {
+        auto render = new AsyncRender(this, output);
+        QFuture<bool> future = render->future();
+        render->start(document);
+        return future;
+    }
+
+    QFuture<bool> renderAsync(const QString &outputPath, const BaseDocument &document) const
+    {
+        return renderAsync(QFileInfo(outputPath), document);
+    }
+
+private:
+    class WarmWorkers;
+
+    QObject *_parent;
+    int _timeoutMSecs;
+    QVector<CommandDescription> _commands;
+    QVector<CommandDescription> _singlePassCommands;
+    QString _formatCacheDir;
+    QString _auxCacheDir;
+    QString _pdfCacheDir;
+    qint64 _pdfCacheMaxBytes = DefaultPdfCacheBytes;
+    int _maxConvergencePasses = 0;
+    bool _coalescedRenders = false;
+    Launcher _launcher = Launcher::QtProcess;
+    int _warmWorkersCount = 0;
+    bool _streamedFirstPass = false;
+    // warm workers belong to one renderer, a copy of the renderer starts its own
+    class WarmWorkersSlot
+    {
+    public:
+        WarmWorkersSlot() = default;
+
+        WarmWorkersSlot(const WarmWorkersSlot &)
+        {}
+
+        WarmWorkersSlot(WarmWorkersSlot &&) = default;
+
+        WarmWorkersSlot &operator=(const WarmWorkersSlot &)
+        {
+            workers.reset();
+            return *this;
+        }
+
+        WarmWorkersSlot &operator=(WarmWorkersSlot &&) = default;
+
+        std::unique_ptr<WarmWorkers> workers;
+    };
+
+    WarmWorkersSlot _warmWorkers;
+    ReportCallback _reportCallback;
+    LogPath _logPath;
+    LogPolicy _logPolicy = LogPolicy::Tail;
+    int _logTailKBytes = DefaultLogTailKBytes;
+    Pipeline _lastPipeline = Pipeline::Full;
+    int _lastPassCount = 0;
+    RenderReport _lastReport;
+
+    const QString TmpTeXFilename = "main.tex";
+    const QString TmpPdfFilename = "main.pdf";
+    const QString TmpAuxFilename = "main.aux";
+    const QString TmpLogFilename = "main.log";
+    const QString TmpBodyFilename = "body.tex";
+    const QString TmpFifoFilename = "stream.tex";
+    const QString TmpJobName = "main";
+    const QString FormatSuffix = ".fmt";
+    const QString AuxSuffix = ".aux";
+    const QString PdfSuffix = ".pdf";
+    static const int SeededMaxPasses = 2;
+    // the counting pass of a split render and at most three passes with the final page offsets
+    static const int SplitMaxPasses = 4;
+    static const int DefaultLogTailKBytes = 64;
+    static const qint64 DefaultPdfCacheBytes = 1024 * 1024 * 1024;
+    const QString FailedFormatSuffix = ".failed";
+    static const qint64 FailedFormatRetrySecs = 60 * 60;
+    const QString LogSuffix = ".log";
+    const QString BatchInteraction = "-interaction=batchmode";
+
+    // per-render state, so renders of one renderer may run concurrently
+    struct RenderState
+    {
+        explicit RenderState(QObject *processParent)
+            : processParent(processParent)
+        {}
+
+        QObject *processParent;
+        Pipeline pipeline = Pipeline::Full;
+        int passCount = 0;
+        RenderReport report;
+        // terminal output of the engines with LogPolicy::File
+        QString logFile;
+    };
+
+    // last bytes written into it, in a buffer allocated on the first write
+    class LogTail
+    {
+    public:
+        explicit LogTail(int capacity)
+            : _capacity(qMax(0, capacity))
+        {}
+
+        void append(const char *data, qint64 size)
+        {
+            if (_capacity == 0 || size <= 0) {
+                return;
+            }
+            if (size > _capacity) {
+                data += size - _capacity;
+                size = _capacity;
+            }
+            if (_buffer.isEmpty()) {
+                _buffer.resize(_capacity);
+            }
+            while (size > 0) {
+                int chunk = int(qMin<qint64>(size, _capacity - _end));
+                memcpy(_buffer.data() + _end, data, size_t(chunk));
+                _end = (_end + chunk) % _capacity;
+                _size = qMin(_size + chunk, _capacity);
+                data += chunk;
+                size -= chunk;
+            }
+        }
+
+        // reads what process has available
+        void append(QProcess &process)
+        {
+            char chunk[16 * 1024];
+            qint64 read = 0;
+            while ((read = process.read(chunk, sizeof(chunk))) > 0) {
+                append(chunk, read);
+            }
+        }
+
+        QByteArray bytes() const
+        {
+            if (_size < _capacity) {
+                return _buffer.left(_size);
+            }
+            return _buffer.mid(_end) + _buffer.left(_end);
+        }
+
+    private:
+        int _capacity;
+        QByteArray _buffer;
+        int _end = 0;
+        int _size = 0;
+    };
+
+    // terminal output log of a render with LogPolicy::File, called as the render starts;
+    // the passes of the render append to it
+    QString logFile(const QFileInfo &output) const
+    {
+        if (_logPolicy != LogPolicy::File) {
+            return QString();
+        }
+        const QString path = _logPath ? _logPath(output) : output.absoluteFilePath() + LogSuffix;
+        return path.isEmpty() ? path : startedLog(path);
+    }
+
+    // log of a part of renderSplit, report.pdf.log gives report.pdf-1.log for the first one
+    static QString partLogFile(const QString &logFile, int part)
+    {
+        const QFileInfo log(logFile);
+        const QString suffix = log.suffix();
+        return startedLog(log.dir().filePath(QString("%1-%2%3").arg(log.completeBaseName()).arg(part + 1)
+            .arg(suffix.isEmpty() ? suffix : "." + suffix)));
+    }
+
+    // empties the log left by an earlier render
+    static QString startedLog(const QString &logFile)
+    {
+        QFile log(logFile);
+        if (log.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            log.close();
+        }
+        return logFile;
+    }
+
+    inline int logTailBytes() const
+    {
+        return _logPolicy == LogPolicy::Tail ? _logTailKBytes * 1024 : 0;
+    }
+
+    // sends the terminal output of process where the log policy says, true if the caller reads it
+    bool setUpLog(QProcess &process, const QString &logFile) const
+    {
+        if (_logPolicy == LogPolicy::Tail) {
+            process.setProcessChannelMode(QProcess::MergedChannels);
+            return true;
+        }
+
+        process.setProcessChannelMode(QProcess::MergedChannels);
+        if (_logPolicy == LogPolicy::File && !logFile.isEmpty()) {
+            process.setStandardOutputFile(logFile, QIODevice::Append);
+        }
+        else {
+            process.setStandardOutputFile(QProcess::nullDevice());
+        }
+        return false;
+    }
+
+    // with LogPolicy::Discard the engine is asked to keep quiet, unless arguments set the interaction mode
+    QStringList withInteraction(const QStringList &arguments) const
+    {
+        if (_logPolicy != LogPolicy::Discard) {
+            return arguments;
+        }
+        for (const auto &argument: arguments) {
+            if (argument.startsWith("-interaction") || argument.startsWith("--interaction")) {
+                return arguments;
+            }
+        }
+
+        QStringList quiet = arguments;
+        quiet.prepend(BatchInteraction);
+        return quiet;
+    }
+
+    // commands of the parts go to report, the log tail is the one of the first failed part or the last part
+    static void mergePartReports(RenderReport &report, std::vector<RenderState> &partStates)
+    {
+        bool failed = false;
+        for (auto &partState: partStates) {
+            report.commands += partState.report.commands;
+            if (!failed) {
+                report.logTail = partState.report.logTail;
+                failed = !partState.report.commands.isEmpty() && !partState.report.commands.last().success;
+            }
+            partState.report.commands.clear();
+        }
+    }
+
+    // wall time and resource usage of one engine process
+    class CommandProbe
+    {
+    public:
+        CommandProbe()
+        {
+            _timer.start();
+        }
+
+        // call after the process has been waited for, its CPU time and peak RSS are not known
+        void record(RenderReport *report, const QString &name, const QStringList &arguments, bool success) const
+        {
+            if (report == nullptr) {
+                return;
+            }
+
+            report->commands.append(measured(name, arguments, success));
+        }
+
+#ifdef Q_OS_UNIX
+        // with the usage of the process itself, as wait4 gives it
+        void record(RenderReport *report,
+                    const QString &name,
+                    const QStringList &arguments,
+                    bool success,
+                    const struct rusage &usage) const
+        {
+            if (report == nullptr) {
+                return;
+            }
+
+            RenderReport::Command command = measured(name, arguments, success);
+            command.userCpuUSecs = usecs(usage.ru_utime);
+            command.systemCpuUSecs = usecs(usage.ru_stime);
+            command.maxRssKBytes = usage.ru_maxrss;
+            report->commands.append(command);
+        }
+#endif
+
+    private:
+        QElapsedTimer _timer;
+
+        RenderReport::Command measured(const QString &name, const QStringList &arguments, bool success) const
+        {
+            RenderReport::Command command;
+            command.name = name;
+            command.arguments = arguments;
+            command.success = success;
+            command.wallNSecs = _timer.nsecsElapsed();
+            return command;
+        }
+#ifdef Q_OS_UNIX
+        static inline qint64 usecs(const struct timeval &time)
+        {
+            return qint64(time.tv_sec) * 1000000 + time.tv_usec;
+        }
+#endif
+    };
+
+    // adds the time since timer was started as a phase and starts the timer again
+    static void notePhase(RenderReport &report, const QString &name, QElapsedTimer &timer)
+    {
+        report.phases.append(RenderReport::Phase(name, timer.nsecsElapsed()));
+        timer.start();
+    }
+
+    void completeReport(RenderState &state, bool success, const QElapsedTimer &timer) const
+    {
+        state.report.success = success;
+        state.report.pipeline = state.pipeline;
+        state.report.passCount = state.passCount;
+        state.report.wallNSecs = timer.nsecsElapsed();
+        if (_reportCallback) {
+            _reportCallback(state.report);
+        }
+    }
+
+    bool renderDocumentSplit(const QFileInfo &output, const BaseDocument &document, int maxParts, RenderState &state) const
+    {
+        const auto parts = document.split(maxParts);
+        if (parts.count() < 2) {
+            return renderDocument(output, document, state);
+        }
+
+        QElapsedTimer phase;
+        phase.start();
+        state.pipeline = Pipeline::Split;
+        const auto commands = withCachedFormats(_commands, document.preamble(), _parent);
+        if (commands.isEmpty()) {
+            return false;
+        }
+        notePhase(state.report, "format", phase);
+        if (renderParts(output, document, parts, commands, state)) {
+            return true;
+        }
+
+        // as runUnformatted does, the parts are compiled again without cached formats once
+        auto unformatted = commands;
+        const QStringList formats = dropCachedFormats(unformatted);
+        if (formats.isEmpty() || !renderParts(output, document, parts, unformatted, state)) {
+            return false;
+        }
+        for (const auto &format: formats) {
+            markFailedFormat(format);
+        }
+        return true;
+    }
+
+    // two passes over every part, the page counts of the first one give the page offsets of the second
+    bool renderParts(const QFileInfo &output,
+                     const BaseDocument &document,
+                     const QVector<QVector<std::shared_ptr<ITeXElement>>> &parts,
+                     const QVector<CommandDescription> &commands,
+                     RenderState &state) const
+    {
+        QElapsedTimer phase;
+        phase.start();
+        std::vector<std::unique_ptr<QTemporaryDir>> dirs;
+        for (int part = 0; part < parts.count(); ++part) {
+            dirs.emplace_back(new QTemporaryDir());
+            if (!dirs.back()->isValid()) {
+                return false;
+            }
+        }
+
+        // one state per part, so the threads do not share a report or a log file
+        std::vector<RenderState> partStates(parts.count(), RenderState(nullptr));
+        if (!state.logFile.isEmpty()) {
+            for (int part = 0; part < parts.count(); ++part) {
+                partStates[part].logFile = partLogFile(state.logFile, part);
+            }
+        }
+        std::vector<int> pageCounts(parts.count(), -1);
+        std::vector<QByteArray> auxHashes(parts.count());
+        std::vector<char> crossReferenced(parts.count(), 0);
+        forEachConcurrently(parts.count(), parts.count(), [&](int part) {
+            bool hasCrossReferences = true;
+            if (compilePart(*dirs[part], document, parts[part], 1, 0, commands.first(), partStates[part],
+                            hasCrossReferences)) {
+                pageCounts[part] = partPageCount(dirs[part]->filePath(TmpLogFilename));
+                auxHashes[part] = fileHash(dirs[part]->filePath(TmpAuxFilename));
+                crossReferenced[part] = hasCrossReferences;
+            }
+        });
+        state.passCount = 1;
+        mergePartReports(state.report, partStates);
+        notePhase(state.report, "first_pass", phase);
+
+        // the first pass only counts pages; the next passes number pages from the offsets of the parts
+        // in the merged document, so labels get their final page numbers; they are repeated while the
+        // page counts change, and while the .aux of a part with cross-references changes, since the
+        // .aux of the previous pass is read and resolved references may change the layout
+        const int maxPasses = _maxConvergencePasses > 0 ? _maxConvergencePasses + 1 : SplitMaxPasses;
+        std::vector<char> compiled(parts.count(), 0);
+        int totalPages = 0;
+        bool converged = false;
+        while (!converged && state.passCount < maxPasses) {
+            QVector<int> firstPages;
+            totalPages = 0;
+            for (int pageCount: pageCounts) {
+                if (pageCount < 0) {
+                    return false;
+                }
+                firstPages.append(totalPages + 1);
+                totalPages += pageCount;
+            }
+
+            std::vector<int> passPageCounts(parts.count(), -1);
+            std::vector<char> stable(parts.count(), 0);
+            forEachConcurrently(parts.count(), parts.count(), [&](int part) {
+                bool hasCrossReferences = true;
+                compiled[part] = compilePart(*dirs[part], document, parts[part], firstPages[part], totalPages,
+                                             commands.last(), partStates[part], hasCrossReferences);
+                if (compiled[part]) {
+                    passPageCounts[part] = partPageCount(dirs[part]->filePath(TmpLogFilename));
+                    bool auxConverged = isConverged(*dirs[part], auxHashes[part]);
+                    stable[part] = passPageCounts[part] == pageCounts[part] && (auxConverged || !crossReferenced[part]);
+                }
+            });
+            ++state.passCount;
+            mergePartReports(state.report, partStates);
+            converged = true;
+            for (int part = 0; part < parts.count(); ++part) {
+                if (!compiled[part]) {
+                    return false;
+                }
+                converged = converged && stable[part];
+            }
+            pageCounts = passPageCounts;
+        }
+        state.report.pageCount = totalPages;
+        state.report.texBytes = 0;
+        for (int part = 0; part < parts.count(); ++part) {
+            state.report.texBytes += QFileInfo(dirs[part]->filePath(TmpTeXFilename)).size();
+        }
+        notePhase(state.report, "final_pass", phase);
+
+        QStringList pdfs;
+        for (int part = 0; part < parts.count(); ++part) {
+            if (!compiled[part]) {
+                return false;
+            }
+            // the engine writes no PDF for a piece without pages
+            if (pageCounts[part] > 0) {
+                pdfs.append(dirs[part]->filePath(TmpPdfFilename));
+            }
+        }
+
+        QTemporaryDir merged;
+        const QString mergedPdf = merged.filePath(TmpPdfFilename);
+        if (!merged.isValid() || !PdfConcatenator::concatenate(pdfs, mergedPdf) || !removeExistingOutputFile(output)) {
+            return false;
+        }
+        bool renamed = QFile::rename(mergedPdf, output.filePath());
+        notePhase(state.report, "concatenate", phase);
+
+        return renamed;
+    }
+
+    // engine passes of one render
+    struct PassPlan
+    {
+        QVector<CommandDescription> commands;
+        // if positive the last command is repeated until converged, at most maxPasses times,
+        // otherwise commands are launched once each
+        int maxPasses = 0;
+        QString cachedAuxFile;
+        // key of the PDF in the PDF cache, empty if the cache is not used
+        QString pdfCacheKey;
+    };
+
+    // renders in flight by TeX and commands, shared by all renderers in the process
+    class Flights
+    {
+    public:
+        struct Flight
+        {
+            bool landed = false;
+            bool success = false;
+            int followers = 0;
+            // private copy of the PDF owned by the flight, so followers never read the output of another
+            // caller; removed with the flight after every follower has taken it
+            std::unique_ptr<QTemporaryDir> dir;
+            QString pdf;
+        };
+
+        // lands the flight of the first caller as a failure unless it is landed explicitly,
+        // so followers never wait for a render that has thrown
+        class Landing
+        {
+        public:
+            Landing(Flights &flights, QString key)
+                : _flights(flights), _key(std::move(key))
+            {}
+
+            ~Landing()
+            {
+                if (!_landed) {
+                    _flights.land(_key, false, nullptr, QString());
+                }
+            }
+
+            void land(bool success, std::unique_ptr<QTemporaryDir> dir, const QString &pdf)
+            {
+                _landed = true;
+                _flights.land(_key, success, std::move(dir), pdf);
+            }
+
+        private:
+            Flights &_flights;
+            QString _key;
+            bool _landed = false;
+        };
+
+        static Flights &instance()
+        {
+            static Flights flights;
+            return flights;
+        }
+
+        // nullptr for the first caller with key, which must land the flight (see Landing); later callers
+        // wait until it lands, at most timeoutMSecs (if not negative), and get its result, a flight that
+        // has not landed then
+        std::shared_ptr<const Flight> join(const QString &key, int timeoutMSecs)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto found = _flights.constFind(key);
+            if (found == _flights.constEnd()) {
+                _flights.insert(key, std::make_shared<Flight>());
+                return nullptr;
+            }
+
+            std::shared_ptr<Flight> flight = found.value();
+            ++flight->followers;
+            auto landed = [&flight]() {
+                return flight->landed;
+            };
+            if (timeoutMSecs < 0) {
+                _landed.wait(lock, landed);
+            }
+            else if (!_landed.wait_for(lock, std::chrono::milliseconds(timeoutMSecs), landed)) {
+                --flight->followers;
+                return std::make_shared<const Flight>();
+            }
+            return flight;
+        }
+
+        // true if a caller waits for the flight of key
+        bool hasFollowers(const QString &key)
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            auto found = _flights.constFind(key);
+            return found != _flights.constEnd() && found.value()->followers > 0;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::condition_variable _landed;
+        QHash<QString, std::shared_ptr<Flight>> _flights;
+
+        void land(const QString &key, bool success, std::unique_ptr<QTemporaryDir> dir, const QString &pdf)
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                auto flight = _flights.take(key);
+                if (flight) {
+                    flight->success = success;
+                    flight->dir = std::move(dir);
+                    flight->pdf = pdf;
+                    flight->landed = true;
+                }
+            }
+            _landed.notify_all();
+        }
+    };
+
+    // engine processes that have loaded a preamble and wait for the path of a document body on stdin
+    class WarmWorkers
+    {
+    public:
+        WarmWorkers(QString preamble, CommandDescription command, int count, int timeoutMSecs)
+            : _preamble(std::move(preamble)), _command(std::move(command)), _count(count), _timeoutMSecs(timeoutMSecs)
+        {
+            fill();
+        }
+
+        ~WarmWorkers()
+        {
+            for (auto &worker: _idle) {
+                stop(worker);
+            }
+        }
+
+        bool serves(const QString &preamble, const CommandDescription &command, int count, int timeoutMSecs) const
+        {
+            return _preamble == preamble && _command.name == command.name && _command.args == command.args
+                && _count == count && _timeoutMSecs == timeoutMSecs;
+        }
+
+        // one engine pass over bodyFile: main.aux of dir is given to an idle worker,
+        // then main.pdf, main.aux and main.log of the worker are moved to dir
+        bool run(const QTemporaryDir &dir, const QString &bodyFile, RenderReport &report)
+        {
+            // workers that died while idle are replaced
+            for (auto worker = _idle.begin(); worker != _idle.end();) {
+                if (worker->process->state() == QProcess::Running) {
+                    ++worker;
+                    continue;
+                }
+                stop(*worker);
+                worker = _idle.erase(worker);
+            }
+            if (_idle.empty()) {
+                fill();
+            }
+            if (_idle.empty()) {
+                return false;
+            }
+            Worker worker = std::move(_idle.front());
+            _idle.erase(_idle.begin());
+            // the replacement loads the preamble while this worker renders
+            fill();
+
+            // the preamble was loaded before, CPU time counts it while the wall time does not
+            CommandProbe probe;
+            bool passed = pass(worker, dir, bodyFile);
+            stop(worker);
+            probe.record(&report, _command.name, worker.process->arguments(), passed);
+            return passed;
+        }
+
+    private:
+        struct Worker
+        {
+            std::unique_ptr<QTemporaryDir> dir;
+            std::unique_ptr<QProcess> process;
+        };
+
+        QString _preamble;
+        CommandDescription _command;
+        int _count;
+        int _timeoutMSecs;
+        std::vector<Worker> _idle;
+
+        const QString JobName = "main";
+        const QString PdfFilename = JobName + ".pdf";
+        const QString AuxFilename = JobName + ".aux";
+        const QString LogFilename = JobName + ".log";
+        const QString DriverFilename = "driver.tex";
+        // \endlinechar=-1 keeps the end of line out of the path
+        const QString Driver = "{\\endlinechar=-1 \\global\\read16 to \\qttexbody}\n"
+                               "\\input{\\qttexbody}\n";
+
+        void fill()
+        {
+            while (int(_idle.size()) < _count) {
+                Worker worker;
+                if (!start(worker)) {
+                    stop(worker);
+                    return;
+                }
+                _idle.push_back(std::move(worker));
+            }
+        }
+
+        bool start(Worker &worker) const
+        {
+            worker.dir.reset(new QTemporaryDir());
+            if (!worker.dir->isValid()) {
+                return false;
+            }
+            const QString driverFile = worker.dir->filePath(DriverFilename);
+            QFile driver(driverFile);
+            if (!driver.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+                return false;
+            }
+            driver.write(_preamble.toUtf8());
+            driver.write("\n");
+            driver.write(Driver.toUtf8());
+            driver.close();
+
+            auto arguments = _command.args;
+            arguments.append(QString("-jobname=%1").arg(JobName));
+            arguments.append(outputDirOption(worker.dir->path()));
+            arguments.append(driverFile);
+
+            // the engine log is in main.log, the terminal output is not read
+            worker.process.reset(new QProcess());
+            worker.process->setStandardOutputFile(QProcess::nullDevice());
+            worker.process->setStandardErrorFile(QProcess::nullDevice());
+            worker.process->start(_command.name, arguments);
+            return worker.process->waitForStarted(_timeoutMSecs);
+        }
+
+        bool pass(Worker &worker, const QTemporaryDir &dir, const QString &bodyFile) const
+        {
+            const QString workerAuxFile = worker.dir->filePath(AuxFilename);
+            QFile::remove(workerAuxFile);
+            if (QFileInfo::exists(dir.filePath(AuxFilename)) && !QFile::copy(dir.filePath(AuxFilename), workerAuxFile)) {
+                return false;
+            }
+
+            QProcess &process = *worker.process;
+            process.write(QFile::encodeName(bodyFile) + '\n');
+            process.closeWriteChannel();
+            if (!process.waitForFinished(_timeoutMSecs)
+                || process.exitStatus() != QProcess::NormalExit
+                || process.exitCode() != 0) {
+                return false;
+            }
+
+            for (const QString &filename: {PdfFilename, AuxFilename, LogFilename}) {
+                QFile::remove(dir.filePath(filename));
+                if (QFileInfo::exists(worker.dir->filePath(filename))
+                    && !QFile::rename(worker.dir->filePath(filename), dir.filePath(filename))) {
+                    return false;
+                }
+            }
+            return true;
+        }
+
+        static void stop(Worker &worker)
+        {
+            if (worker.process && worker.process->state() != QProcess::NotRunning) {
+                worker.process->kill();
+                worker.process->waitForFinished();
+            }
+        }
+    };
+
+    // drives the passes of renderAsync, deletes itself when the render is finished
+    class AsyncRender final: public QObject
+    {
+    public:
+        AsyncRender(const PdfFileRenderer *renderer, const QFileInfo &output)
+            : _renderer(renderer), _output(output), _state(this), _tail(renderer->logTailBytes())
+        {
+            _elapsed.start();
+            _state.logFile = renderer->logFile(output);
+            _promise.reportStarted();
+            _timer.setSingleShot(true);
+            QObject::connect(&_timer, &QTimer::timeout, this, [this]() {
+                if (_process != nullptr) {
+                    _process->kill();
+                }
+            });
+        }
+
+        QFuture<bool> future()
+        {
+            return _promise.future();
+        }
+
+        ~AsyncRender() override
+        {
+            if (_preparing.joinable()) {
+                _preparing.join();
+            }
+        }
+
+        // the TeX file, the engine version and the format are prepared off the event loop,
+        // the result comes back through a future watched in the event loop
+        void start(const BaseDocument &document)
+        {
+            QObject::connect(&_preparedWatcher, &QFutureWatcher<bool>::finished, this, [this]() {
+                onPrepared(_preparedWatcher.result());
+            });
+            _prepared.reportStarted();
+            _preparedWatcher.setFuture(_prepared.future());
+
+            // processes of the preparing thread must not have a parent in the event loop thread
+            _state.processParent = nullptr;
+            _preparing = std::thread([this, &document]() {
+                bool prepared = false;
+                try {
+                    prepared = _renderer->prepareRender(_state, _tmp, _output, document, _texFile, _plan);
+                }
+                catch (...) {
+                    prepared = false;
+                }
+                _prepared.reportResult(prepared);
+                _prepared.reportFinished();
+            });
+        }
+
+    private:
+        const PdfFileRenderer *_renderer;
+        QFileInfo _output;
+        RenderState _state;
+        QTemporaryDir _tmp;
+        QString _texFile;
+        PassPlan _plan;
+        QByteArray _auxHash;
+        QFutureInterface<bool> _promise;
+        QTimer _timer;
+        QProcess *_process = nullptr;
+        CommandProbe _probe;
+        LogTail _tail;
+        QElapsedTimer _elapsed;
+        std::thread _preparing;
+        QFutureInterface<bool> _prepared;
+        QFutureWatcher<bool> _preparedWatcher;
+        // formats dropped after failed passes, marked failed if the render succeeds without them
+        QStringList _droppedFormats;
+        bool _completed = false;
+
+        void onPrepared(bool prepared)
+        {
+            _preparing.join();
+            _state.processParent = this;
+            if (!prepared || _state.pipeline == Pipeline::Cached) {
+                complete(prepared);
+                return;
+            }
+
+            _auxHash = fileHash(_tmp.filePath(_renderer->TmpAuxFilename));
+            launchNextPass();
+        }
+
+        void launchNextPass()
+        {
+            const CommandDescription &command = _plan.maxPasses > 0
+                ? _plan.commands.last()
+                : _plan.commands[_state.passCount];
+            ++_state.passCount;
+
+            auto arguments = command.args;
+            arguments.append(outputDirOption(_tmp.path()));
+            arguments.append(_texFile);
+
+            _process = new QProcess(this);
+            _tail = LogTail(_renderer->logTailBytes());
+            if (_renderer->setUpLog(*_process, _state.logFile)) {
+                QObject::connect(_process, &QProcess::readyRead, this, [this]() {
+                    _tail.append(*_process);
+                });
+            }
+            QObject::connect(
+                _process,
+                static_cast<void (QProcess::*)(int, QProcess::ExitStatus)>(&QProcess::finished),
+                this,
+                [this](int exitCode, QProcess::ExitStatus exitStatus) {
+                    onPassFinished(exitCode == 0 && exitStatus == QProcess::NormalExit);
+                });
+            // only a process that failed to start never emits finished: a crash is followed by finished
+            // with QProcess::CrashExit, Timedout comes from the waitFor functions, which are not used here,
+            // and read or write errors leave the process running until it finishes or the timer kills it
+            QObject::connect(_process, &QProcess::errorOccurred, this, [this](QProcess::ProcessError error) {
+                if (error == QProcess::FailedToStart) {
+                    onPassFinished(false);
+                }
+            });
+            _probe = CommandProbe();
+            _process->start(command.name, _renderer->withInteraction(arguments));
+            _timer.start(_renderer->_timeoutMSecs);
+        }
+
+        void onPassFinished(bool passed)
+        {
+            _timer.stop();
+            if (_process != nullptr) {
+                _probe.record(&_state.report, _process->program(), _process->arguments(), passed);
+                _tail.append(*_process);
+                _state.report.logTail = _tail.bytes();
+                _process->deleteLater();
+                _process = nullptr;
+            }
+            if (!passed && retryUnformatted()) {
+                return;
+            }
+            if (!passed && _renderer->unseed(_state, _tmp, _texFile, _plan)) {
+                _auxHash = fileHash(_tmp.filePath(_renderer->TmpAuxFilename));
+                launchNextPass();
+                return;
+            }
+            if (!passed) {
+                complete(false);
+                return;
+            }
+
+            bool morePasses = _plan.maxPasses > 0
+                ? _state.passCount < _plan.maxPasses && !_renderer->isConverged(_tmp, _auxHash)
+                : _state.passCount < _plan.commands.count();
+            if (morePasses) {
+                launchNextPass();
+            }
+            else {
+                bool finished = _renderer->finishRender(_state, _tmp, _output, _plan);
+                if (finished) {
+                    for (const auto &format: _droppedFormats) {
+                        _renderer->markFailedFormat(format);
+                    }
+                }
+                complete(finished);
+            }
+        }
+
+        // as runUnformatted does, the passes start over without cached formats once
+        bool retryUnformatted()
+        {
+            PassPlan unformatted = _plan;
+            const QStringList formats = dropCachedFormats(unformatted.commands);
+            if (formats.isEmpty() || !_renderer->restartPasses(_state, _tmp, _texFile, unformatted)) {
+                return false;
+            }
+            _plan = unformatted;
+            _droppedFormats = formats;
+            _auxHash = fileHash(_tmp.filePath(_renderer->TmpAuxFilename));
+            launchNextPass();
+            return true;
+        }
+
+        void complete(bool success)
+        {
+            if (_completed) {
+                return;
+            }
+            _completed = true;
+            _renderer->completeReport(_state, success, _elapsed);
+            _promise.reportResult(success);
+            _promise.reportFinished();
+            deleteLater();
+        }
+    };
+
+    bool renderDocument(const QFileInfo &output, const BaseDocument &document, RenderState &state) const
+    {
+#ifdef Q_OS_UNIX
+        if (_streamedFirstPass && !_commands.isEmpty()) {
+            return renderStreamed(output, document, state);
+        }
+#endif
+        QTemporaryDir tmp;
+        QString tmpTexFile;
+        PassPlan plan;
+        if (!prepareRender(state, tmp, output, document, tmpTexFile, plan)) {
+            return false;
+        }
+        if (state.pipeline == Pipeline::Cached) {
+            return true;
+        }
+        if (!_coalescedRenders) {
+            return renderPrepared(output, state, tmp, tmpTexFile, plan);
+        }
+
+        QElapsedTimer phase;
+        phase.start();
+        const QString key = plan.pdfCacheKey.isEmpty() ? pdfCacheKey(tmpTexFile) : plan.pdfCacheKey;
+        Flights &flights = Flights::instance();
+        auto flight = flights.join(key, _timeoutMSecs);
+        if (!flight) {
+            Flights::Landing landing(flights, key);
+            bool passed = runPasses(state, tmp, tmpTexFile, plan);
+            // followers get a copy owned by the flight, taken before the PDF is moved to the output of
+            // this caller, so they do not depend on that output
+            std::unique_ptr<QTemporaryDir> dir;
+            QString pdf;
+            if (passed && flights.hasFollowers(key)) {
+                dir.reset(new QTemporaryDir());
+                pdf = dir->filePath(TmpPdfFilename);
+                if (!dir->isValid() || !deliverFile(tmp.filePath(TmpPdfFilename), pdf)) {
+                    dir.reset();
+                    pdf.clear();
+                }
+            }
+            landing.land(passed, std::move(dir), pdf);
+            return passed && finishRender(state, tmp, output, plan);
+        }
+
+        notePhase(state.report, "coalesce", phase);
+        // the first render may run several passes, each within the timeout, so a follower that
+        // has waited one timeout renders by itself
+        if (!flight->landed) {
+            return renderPrepared(output, state, tmp, tmpTexFile, plan);
+        }
+        if (!flight->success) {
+            return false;
+        }
+        if (!flight->pdf.isEmpty() && removeExistingOutputFile(output) && deliverFile(flight->pdf, output.filePath())) {
+            state.pipeline = Pipeline::Coalesced;
+            return true;
+        }
+
+        // no copy was made for a follower that joined as the first render finished
+        return renderPrepared(output, state, tmp, tmpTexFile, plan);
+    }
+
+    // engine passes over the TeX written by prepareRender, then the PDF is moved to output
+    bool renderPrepared(const QFileInfo &output,
+                        RenderState &state,
+                        const QTemporaryDir &tmp,
+                        const QString &tmpTexFile,
+                        const PassPlan &plan) const
+    {
+        return runPasses(state, tmp, tmpTexFile, plan) && finishRender(state, tmp, output, plan);
+    }
+
+    // passes of plan leaving main.pdf in tmp; a failed render is retried without cached formats,
+    // a failed seeded render unseeded
+    bool runPasses(RenderState &state, const QTemporaryDir &tmp, const QString &tmpTexFile, const PassPlan &plan) const
+    {
+        bool passed = true;
+        if (plan.maxPasses > 0) {
+            passed = launchUntilConverged(state, tmp, tmpTexFile, plan.commands.last(), plan.maxPasses);
+        }
+        else {
+            for (const auto &command: plan.commands) {
+                ++state.passCount;
+                if (!launchCommandOverTexFile(state, tmp.path(), tmpTexFile, command.name, command.args)) {
+                    passed = false;
+                    break;
+                }
+            }
+        }
+        if (passed) {
+            return true;
+        }
+
+        PassPlan unformatted = plan;
+        const QStringList formats = dropCachedFormats(unformatted.commands);
+        if (!formats.isEmpty()) {
+            return runUnformatted(state, tmp, tmpTexFile, unformatted, formats);
+        }
+
+        PassPlan unseeded = plan;
+        if (!unseed(state, tmp, tmpTexFile, unseeded)) {
+            return false;
+        }
+        return runPasses(state, tmp, tmpTexFile, unseeded);
+    }
+
+    // a format may be dumped and still break when it is loaded (e.g. Lua state of LuaLaTeX packages),
+    // so passes failed with cached formats are repeated once over the same TeX without them;
+    // the formats are marked failed if those passes succeed, a broken document does not drop them
+    bool runUnformatted(RenderState &state,
+                        const QTemporaryDir &tmp,
+                        const QString &tmpTexFile,
+                        const PassPlan &plan,
+                        const QStringList &formats) const
+    {
+        if (!restartPasses(state, tmp, tmpTexFile, plan) || !runPasses(state, tmp, tmpTexFile, plan)) {
+            return false;
+        }
+
+        for (const auto &format: formats) {
+            markFailedFormat(format);
+        }
+        return true;
+    }
+
+    // clears tmp for passes over the same TeX from the start, a seeded render is seeded again
+    bool restartPasses(RenderState &state, const QTemporaryDir &tmp, const QString &tmpTexFile, const PassPlan &plan) const
+    {
+        clearPassOutput(tmp, tmpTexFile);
+        state.passCount = 0;
+        return state.pipeline != Pipeline::Seeded || seedAuxFile(tmp, plan.cachedAuxFile);
+    }
+
+    // the .aux of an earlier render may break a seeded render (e.g. macros of a removed package),
+    // so it is dropped with everything the failed passes wrote and the plan starts over unseeded;
+    // false if the render was not seeded
+    bool unseed(RenderState &state, const QTemporaryDir &tmp, const QString &tmpTexFile, PassPlan &plan) const
+    {
+        if (state.pipeline != Pipeline::Seeded) {
+            return false;
+        }
+
+        QFile::remove(plan.cachedAuxFile);
+        clearPassOutput(tmp, tmpTexFile);
+        state.pipeline = _maxConvergencePasses > 0 ? Pipeline::Converged : Pipeline::Full;
+        state.passCount = 0;
+        plan.maxPasses = _maxConvergencePasses;
+        return true;
+    }
+
+    // removes everything engine passes wrote into tmp, only the TeX is kept
+    static void clearPassOutput(const QTemporaryDir &tmp, const QString &tmpTexFile)
+    {
+        const QString texFile = QFileInfo(tmpTexFile).absoluteFilePath();
+        for (const auto &file: QDir(tmp.path()).entryInfoList(QDir::Files)) {
+            if (file.absoluteFilePath() != texFile) {
+                QFile::remove(file.absoluteFilePath());
+            }
+        }
+    }
+
+    // passes over the document body in warm workers, repeated until converged for cross-references
+    bool renderWarm(const QFileInfo &output, const BaseDocument &document, RenderState &state)
+    {
+        QElapsedTimer phase;
+        phase.start();
+        QTemporaryDir tmp;
+        const QString bodyFile = tmp.filePath(TmpBodyFilename);
+        const QString preamble = document.preamble();
+        bool hasCrossReferences = true;
+        if (!tmp.isValid() || !writeBodyFile(document, bodyFile, hasCrossReferences)) {
+            return false;
+        }
+        state.report.texBytes = QFileInfo(bodyFile).size();
+        notePhase(state.report, "tex", phase);
+        hasCrossReferences = hasCrossReferences || LaTeXSymbols::hasCrossReference(preamble.constData(), preamble.size());
+
+        // format files are not used, a format dumped with the preamble would skip the preamble of the driver
+        const CommandDescription &command = _commands.last();
+        auto &workers = _warmWorkers.workers;
+        if (!workers || !workers->serves(preamble, command, _warmWorkersCount, _timeoutMSecs)) {
+            workers.reset();
+            workers.reset(new WarmWorkers(preamble, command, _warmWorkersCount, _timeoutMSecs));
+        }
+
+        state.pipeline = Pipeline::Warm;
+        state.passCount = 0;
+        PassPlan plan;
+        plan.cachedAuxFile = auxCacheFile(output, document);
+        bool seeded = hasCrossReferences && seedAuxFile(tmp, plan.cachedAuxFile);
+        int maxPasses = hasCrossReferences ? crossReferencePasses(seeded) : 1;
+
+        QByteArray auxHash = fileHash(tmp.filePath(TmpAuxFilename));
+        while (state.passCount < maxPasses) {
+            ++state.passCount;
+            if (!workers->run(tmp, bodyFile, state.report)) {
+                // a stale seed must not break the next renders too
+                if (seeded) {
+                    QFile::remove(plan.cachedAuxFile);
+                }
+                // a worker may have failed to start or died while idle, so the passes are repeated cold
+                // over the body written already; row generators of the document are used up by now
+                return renderBodyCold(output, state, tmp, preamble, bodyFile, hasCrossReferences, plan);
+            }
+            if (isConverged(tmp, auxHash)) {
+                break;
+            }
+        }
+
+        return finishRender(state, tmp, output, plan);
+    }
+
+    // cold passes over main.tex made of the preamble and an \input of bodyFile; formats are not used,
+    // a format dumped with the preamble expects \begin{document} in the main file
+    bool renderBodyCold(const QFileInfo &output,
+                        RenderState &state,
+                        const QTemporaryDir &tmp,
+                        const QString &preamble,
+                        const QString &bodyFile,
+                        bool hasCrossReferences,
+                        PassPlan plan) const
+    {
+        const QString texFile = tmp.filePath(TmpTeXFilename);
+        QFile tex(texFile);
+        if (!tex.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            return false;
+        }
+        tex.write(preamble.toUtf8());
+        tex.write("\n\\input{");
+        tex.write(bodyFile.toUtf8());
+        tex.write("}\n");
+        if (!tex.flush()) {
+            return false;
+        }
+        tex.close();
+        // a failed worker pass may have left output of the previous passes
+        for (const QString &filename: {TmpPdfFilename, TmpAuxFilename, TmpLogFilename}) {
+            QFile::remove(tmp.filePath(filename));
+        }
+
+        if (hasCrossReferences || _singlePassCommands.isEmpty()) {
+            state.pipeline = _maxConvergencePasses > 0 ? Pipeline::Converged : Pipeline::Full;
+            plan.commands = _commands;
+        }
+        else {
+            state.pipeline = Pipeline::SinglePass;
+            plan.commands = _singlePassCommands;
+        }
+        plan.maxPasses = state.pipeline == Pipeline::Converged ? _maxConvergencePasses : 0;
+        state.passCount = 0;
+        return renderPrepared(output, state, tmp, texFile, plan);
+    }
+
+    // passes over a document with cross-references for the pipelines that repeat the final command
+    int crossReferencePasses(bool seeded) const
+    {
+        if (_maxConvergencePasses > 0) {
+            return _maxConvergencePasses;
+        }
+        int seededMaxPasses = SeededMaxPasses;
+        return seeded ? seededMaxPasses : _commands.count();
+    }
+
+    bool writeBodyFile(const BaseDocument &document, const QString &bodyFile, bool &hasCrossReferences) const
+    {
+        QFile outputFile(bodyFile);
+        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered)) {
+            return false;
+        }
+        bool written = false;
+        {
+            Utf8FileSink sink(outputFile);
+            document.renderBody(sink);
+            hasCrossReferences = sink.hasCrossReferences();
+            written = sink.written();
+        }
+        outputFile.close();
+
+        return written;
+    }
+
+#ifdef Q_OS_UNIX
+    // writes the stream into the FIFO read by the engine and into main.tex for the later passes;
+    // the FIFO is non-blocking, so an engine that stops reading fails the stream after timeoutMSecs
+    class FifoSink final: public Utf8Sink
+    {
+    public:
+        FifoSink(int fifo, QFile &texFile, int timeoutMSecs)
+            : _fifo(fifo), _texFile(texFile), _timeoutMSecs(timeoutMSecs)
+        {
+            _timer.start();
+        }
+
+        // false if the engine has closed the FIFO or stopped reading, it has failed then
+        inline bool streamed() const
+        {
+            return !_broken;
+        }
+
+        // true if a write failed with EPIPE, so a SIGPIPE is pending on this thread
+        inline bool brokenPipe() const
+        {
+            return _brokenPipe;
+        }
+
+    protected:
+        void writeBytes(const char *data, qint64 size) override
+        {
+            _texFile.write(data, size);
+            while (!_broken && size > 0) {
+                ssize_t written = ::write(_fifo, data, size_t(size));
+                if (written < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (written < 0 && errno == EAGAIN) {
+                    _broken = !waitWritable();
+                    continue;
+                }
+                if (written <= 0) {
+                    _brokenPipe = written < 0 && errno == EPIPE;
+                    _broken = true;
+                    break;
+                }
+                data += written;
+                size -= written;
+            }
+        }
+
+    private:
+        int _fifo;
+        QFile &_texFile;
+        int _timeoutMSecs;
+        QElapsedTimer _timer;
+        bool _broken = false;
+        bool _brokenPipe = false;
+
+        // false if the engine has not read from the full FIFO before the timeout
+        bool waitWritable() const
+        {
+            pollfd descriptor;
+            descriptor.fd = _fifo;
+            descriptor.events = POLLOUT;
+            while (true) {
+                int remainingMSecs = _timeoutMSecs < 0 ? -1 : int(qMax<qint64>(0, _timeoutMSecs - _timer.elapsed()));
+                int ready = ::poll(&descriptor, 1, remainingMSecs);
+                if (ready < 0 && errno == EINTR) {
+                    continue;
+                }
+                // an engine that closed the FIFO is reported by the next write
+                return ready > 0;
+            }
+        }
+    };
+
+    // the first pass reads the document from a FIFO while it is generated,
+    // later passes (cross-references) read main.tex written along the way
+    bool renderStreamed(const QFileInfo &output, const BaseDocument &document, RenderState &state) const
+    {
+        QTemporaryDir tmp;
+        const QString fifoFile = tmp.filePath(TmpFifoFilename);
+        const QString texFile = tmp.filePath(TmpTeXFilename);
+        if (!tmp.isValid() || ::mkfifo(QFile::encodeName(fifoFile).constData(), 0600) != 0) {
+            return false;
+        }
+        QElapsedTimer phase;
+        phase.start();
+        const auto commands = withCachedFormats(_commands, document.preamble(), state.processParent);
+        if (commands.isEmpty()) {
+            return false;
+        }
+        notePhase(state.report, "format", phase);
+        const CommandDescription &command = commands.last();
+
+        state.pipeline = Pipeline::Streamed;
+        state.passCount = 1;
+        PassPlan plan;
+        plan.cachedAuxFile = auxCacheFile(output, document);
+        bool seeded = seedAuxFile(tmp, plan.cachedAuxFile);
+        QByteArray auxHash = fileHash(tmp.filePath(TmpAuxFilename));
+
+        // the terminal output is discarded, otherwise the engine blocks on a full stdout pipe
+        // while this thread blocks on the FIFO
+        auto arguments = command.args;
+        arguments.append(QString("-jobname=%1").arg(TmpJobName));
+        arguments.append(outputDirOption(tmp.path()));
+        arguments.append(fifoFile);
+        CommandProbe probe;
+        QProcess engine(state.processParent);
+        engine.setStandardOutputFile(QProcess::nullDevice());
+        engine.setStandardErrorFile(QProcess::nullDevice());
+        engine.start(command.name, arguments);
+        engine.closeWriteChannel();
+
+        bool hasCrossReferences = true;
+        bool streamed = streamIntoFifo(engine, fifoFile, texFile, document, hasCrossReferences);
+        if (!streamed) {
+            engine.kill();
+        }
+        bool passed = engine.waitForFinished(_timeoutMSecs) && streamed
+            && engine.exitStatus() == QProcess::NormalExit && engine.exitCode() == 0;
+        probe.record(&state.report, command.name, arguments, passed);
+        // the TeX is generated while the first pass runs, so there is no tex phase
+        state.report.texBytes = QFileInfo(texFile).size();
+        if (passed && hasCrossReferences && !isConverged(tmp, auxHash)) {
+            passed = launchUntilConverged(state, tmp, texFile, command, crossReferencePasses(seeded));
+        }
+        if (!passed) {
+            plan.commands = commands;
+            const QStringList formats = dropCachedFormats(plan.commands);
+            if (streamed && !formats.isEmpty()) {
+                // main.tex is complete, so it is compiled again as a Full or Seeded render would do
+                state.pipeline = seeded ? Pipeline::Seeded
+                                        : _maxConvergencePasses > 0 ? Pipeline::Converged : Pipeline::Full;
+                plan.maxPasses = seeded || _maxConvergencePasses > 0 ? crossReferencePasses(seeded) : 0;
+                return runUnformatted(state, tmp, texFile, plan, formats) && finishRender(state, tmp, output, plan);
+            }
+            // a stale seed must not break the next renders too
+            if (seeded) {
+                QFile::remove(plan.cachedAuxFile);
+            }
+            return false;
+        }
+
+        return finishRender(state, tmp, output, plan);
+    }
+
+    bool streamIntoFifo(QProcess &engine,
+                        const QString &fifoFile,
+                        const QString &texFile,
+                        const BaseDocument &document,
+                        bool &hasCrossReferences) const
+    {
+        QFile tex(texFile);
+        if (!tex.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            return false;
+        }
+
+        // non-blocking open fails until the engine opens the FIFO, so an engine that exits early
+        // does not leave this thread blocked
+        const QByteArray fifoPath = QFile::encodeName(fifoFile);
+        QElapsedTimer timer;
+        timer.start();
+        int fifo = -1;
+        while ((fifo = ::open(fifoPath.constData(), O_WRONLY | O_NONBLOCK)) < 0) {
+            if (errno != ENXIO || engine.waitForFinished(10) || engine.state() == QProcess::NotRunning
+                || timer.elapsed() > _timeoutMSecs) {
+                return false;
+            }
+        }
+
+        // an engine that stops reading makes write fail with EPIPE instead of killing the process
+        sigset_t sigpipe;
+        sigset_t previousMask;
+        sigemptyset(&sigpipe);
+        sigaddset(&sigpipe, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &sigpipe, &previousMask);
+
+        bool streamed = false;
+        bool brokenPipe = false;
+        try {
+            FifoSink sink(fifo, tex, _timeoutMSecs);
+            document.render(sink);
+            hasCrossReferences = sink.hasCrossReferences();
+            streamed = sink.streamed();
+            brokenPipe = sink.brokenPipe();
+        }
+        catch (...) {
+            streamed = false;
+        }
+        ::close(fifo);
+        bool written = tex.error() == QFileDevice::NoError;
+        tex.close();
+        written = written && tex.error() == QFileDevice::NoError;
+
+        // the SIGPIPE raised by the failed write is taken here, so it is not delivered when the mask
+        // is restored; without such a write a pending SIGPIPE belongs to someone else and is left alone
+        if (brokenPipe) {
+            timespec noWait = {0, 0};
+            while (sigtimedwait(&sigpipe, nullptr, &noWait) < 0 && errno == EINTR) {
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &previousMask, nullptr);
+
+        return streamed && written;
+    }
+#endif
+
+    // writes the TeX file and chooses the pipeline
+    bool prepareRender(RenderState &state,
+                       const QTemporaryDir &tmp,
+                       const QFileInfo &output,
+                       const BaseDocument &document,
+                       QString &tmpTexFile,
+                       PassPlan &plan) const
+    {
+        QElapsedTimer phase;
+        phase.start();
+        bool hasCrossReferences = true;
+        if (!tmp.isValid() || !writeTmpTexFile(state, tmp, document, tmpTexFile, hasCrossReferences)) {
+            return false;
+        }
+        state.report.texBytes = QFileInfo(tmpTexFile).size();
+        notePhase(state.report, "tex", phase);
+        if (!_pdfCacheDir.isEmpty()) {
+            bool timeDependent = false;
+            plan.pdfCacheKey = pdfCacheKey(tmpTexFile, &timeDependent);
+            if (timeDependent) {
+                plan.pdfCacheKey.clear();
+            }
+            bool delivered = deliverCachedPdf(plan.pdfCacheKey, output);
+            notePhase(state.report, "cache", phase);
+            if (delivered) {
+                state.pipeline = Pipeline::Cached;
+                return true;
+            }
+        }
+        state.pipeline = hasCrossReferences || _singlePassCommands.isEmpty() ? Pipeline::Full : Pipeline::SinglePass;
+        plan.commands = withCachedFormats(
+            state.pipeline == Pipeline::Full ? _commands : _singlePassCommands,
+            document.preamble(),
+            state.processParent);
+        if (plan.commands.isEmpty()) {
+            return false;
+        }
+        notePhase(state.report, "format", phase);
+        state.passCount = 0;
+        plan.cachedAuxFile = auxCacheFile(output, document);
+        if (state.pipeline == Pipeline::Full && seedAuxFile(tmp, plan.cachedAuxFile)) {
+            state.pipeline = Pipeline::Seeded;
+            plan.maxPasses = SeededMaxPasses;
+            if (_maxConvergencePasses > 0) {
+                plan.maxPasses = _maxConvergencePasses;
+            }
+        }
+        else if (state.pipeline == Pipeline::Full && _maxConvergencePasses > 0) {
+            state.pipeline = Pipeline::Converged;
+            plan.maxPasses = _maxConvergencePasses;
+        }
+
+        return true;
+    }
+
+    // keeps the .aux and the PDF for the next renders and moves the PDF to output
+    bool finishRender(RenderState &state,
+                      const QTemporaryDir &tmp,
+                      const QFileInfo &output,
+                      const PassPlan &plan) const
+    {
+        QElapsedTimer phase;
+        phase.start();
+        state.report.pageCount = logPageCount(tmp.filePath(TmpLogFilename));
+        if (state.pipeline != Pipeline::SinglePass) {
+            storeAuxFile(tmp, plan.cachedAuxFile);
+        }
+        storeCachedPdf(tmp.filePath(TmpPdfFilename), plan.pdfCacheKey);
+        if (!removeExistingOutputFile(output)) {
+            return false;
+        }
+        bool renamed = QFile::rename(tmp.filePath(TmpPdfFilename), output.filePath());
+        notePhase(state.report, "finish", phase);
+
+        return renamed;
+    }
+
+    bool writeTmpTexFile(RenderState &state,
+                         const QTemporaryDir &tmp,
+                         const BaseDocument &document,
+                         QString &outputTexFile,
+                         bool &hasCrossReferences) const
+    {
+        QString tmpTexFile = tmp.filePath(TmpTeXFilename);
+        TeXFileRenderer texFileRenderer(state.processParent);
+        outputTexFile = tmpTexFile;
+        bool written = texFileRenderer.render(tmpTexFile, document);
+        hasCrossReferences = texFileRenderer.hasCrossReferences();
+        return written;
+    }
+
+    // writes a part of the split document into tmp and runs command over it
+    bool compilePart(const QTemporaryDir &tmp,
+                     const BaseDocument &document,
+                     const QVector<std::shared_ptr<ITeXElement>> &elements,
+                     int firstPage,
+                     int totalPages,
+                     const CommandDescription &command,
+                     RenderState &state,
+                     bool &hasCrossReferences) const
+    {
+        const QString texFile = tmp.filePath(TmpTeXFilename);
+        QFile outputFile(texFile);
+        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Unbuffered)) {
+            return false;
+        }
+        try {
+            Utf8FileSink sink(outputFile);
+            document.renderPart(sink, elements, firstPage, totalPages);
+            hasCrossReferences = sink.hasCrossReferences();
+            if (!sink.written()) {
+                return false;
+            }
+        }
+        catch (...) {
+            return false;
+        }
+        outputFile.close();
+
+        return launchCommandOverTexFile(state, tmp.path(), texFile, command.name, command.args);
+    }
+
+    // page count written by BaseDocument::renderPart into the log, -1 if it is missing
+    static int partPageCount(const QString &logPath)
+    {
+        static const qint64 TailSize = 64 * 1024;
+
+        QFile log(logPath);
+        if (!log.open(QIODevice::ReadOnly)) {
+            return -1;
+        }
+        if (log.size() > TailSize) {
+            log.seek(log.size() - TailSize);
+        }
+        const QByteArray tail = log.readAll();
+        const QByteArray marker = BaseDocument::partPagesMarker().toLatin1();
+        int position = tail.lastIndexOf(marker);
+        if (position < 0) {
+            return -1;
+        }
+
+        position += marker.size();
+        int end = position;
+        while (end < tail.size() && tail[end] >= '0' && tail[end] <= '9') {
+            ++end;
+        }
+        bool parsed = false;
+        int pageCount = tail.mid(position, end - position).toInt(&parsed);
+        return parsed ? pageCount : -1;
+    }
+
+    // page count from "Output written on main.pdf (N pages, M bytes)." of the engine log, -1 if it is missing
+    static int logPageCount(const QString &logPath)
+    {
+        static const qint64 TailSize = 64 * 1024;
+
+        QFile log(logPath);
+        if (!log.open(QIODevice::ReadOnly)) {
+            return -1;
+        }
+        if (log.size() > TailSize) {
+            log.seek(log.size() - TailSize);
+        }
+        // the engine wraps log lines, the message may be broken anywhere
+        QByteArray tail = log.readAll();
+        tail.replace("\r", "").replace("\n", "");
+        if (tail.contains("No pages of output.")) {
+            return 0;
+        }
+        int position = tail.lastIndexOf("Output written on ");
+        if (position < 0 || (position = tail.indexOf(" (", position)) < 0) {
+            return -1;
+        }
+
+        position += 2;
+        int end = position;
+        while (end < tail.size() && tail[end] >= '0' && tail[end] <= '9') {
+            ++end;
+        }
+        bool parsed = false;
+        int pageCount = tail.mid(position, end - position).toInt(&parsed);
+        return parsed ? pageCount : -1;
+    }
+
+    // calls function(index) for every index below count on up to maxConcurrency threads,
+    // the calling thread is one of them
+    template<class Function>
+    static void forEachConcurrently(int count, int maxConcurrency, Function function)
+    {
+        std::atomic<int> next(0);
+        auto worker = [count, &next, &function]() {
+            for (int index = next++; index < count; index = next++) {
+                function(index);
+            }
+        };
+
+        int threadsCount = qBound(1, maxConcurrency, qMax(1, count));
+        std::vector<std::thread> threads;
+        threads.reserve(threadsCount - 1);
+        for (int i = 1; i < threadsCount; ++i) {
+            threads.emplace_back(worker);
+        }
+        worker();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    }
+
+    bool launchCommandOverTexFile(RenderState &state,
+                                  const QString &dir,
+                                  const QString &texFile,
+                                  const QString &commandName,
+                                  const QStringList &commandArgs) const
+    {
+        auto launchArguments = commandArgs;
+        launchArguments.append(outputDirOption(dir));
+        launchArguments.append(texFile);
+
+        return launchCommand(state.processParent, commandName, launchArguments, &state);
+    }
+
+    bool launchUntilConverged(RenderState &state,
+                              const QTemporaryDir &tmp,
+                              const QString &texFile,
+                              const CommandDescription &command,
+                              int maxPasses) const
+    {
+        QByteArray auxHash = fileHash(tmp.filePath(TmpAuxFilename));
+        while (state.passCount < maxPasses) {
+            ++state.passCount;
+            if (!launchCommandOverTexFile(state, tmp.path(), texFile, command.name, command.args)) {
+                return false;
+            }
+            if (isConverged(tmp, auxHash)) {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    // checks the pass that has just finished, auxHash is the .aux hash before it and is updated
+    bool isConverged(const QTemporaryDir &tmp, QByteArray &auxHash) const
+    {
+        QByteArray newAuxHash = fileHash(tmp.filePath(TmpAuxFilename));
+        bool auxChanged = !auxHash.isEmpty() && auxHash != newAuxHash;
+        auxHash = newAuxHash;
+
+        return !auxChanged && !logRequestsRerun(tmp.filePath(TmpLogFilename));
+    }
+
+    QString auxCacheFile(const QFileInfo &output, const BaseDocument &document) const
+    {
+        if (_auxCacheDir.isEmpty()) {
+            return {};
+        }
+
+        const QString identity = document.identity().isEmpty() ? output.absoluteFilePath() : document.identity();
+        const QByteArray key = QCryptographicHash::hash(identity.toUtf8(), QCryptographicHash::Sha1).toHex();
+        return QDir(_auxCacheDir).absoluteFilePath(QString::fromLatin1(key) + AuxSuffix);
+    }
+
+    bool seedAuxFile(const QTemporaryDir &tmp, const QString &cachedAuxFile) const
+    {
+        if (cachedAuxFile.isEmpty() || !QFileInfo::exists(cachedAuxFile)) {
+            return false;
+        }
+
+        return QFile::copy(cachedAuxFile, tmp.filePath(TmpAuxFilename));
+    }
 
-        for (auto const &columnType: options.columnsTypes) {
-            preamble.append(columnType.asCommand());
+    void storeAuxFile(const QTemporaryDir &tmp, const QString &cachedAuxFile) const
+    {
+        if (cachedAuxFile.isEmpty() || !QDir(_auxCacheDir).mkpath(".")) {
+            return;
         }
 
-        return preamble.join('\n');
+        // copied next to the cached file and renamed, so concurrent renders never read a partial .aux
+        QTemporaryFile stored(cachedAuxFile + ".XXXXXX");
+        stored.setAutoRemove(false);
+        if (!stored.open()) {
+            return;
+        }
+        QFile aux(tmp.filePath(TmpAuxFilename));
+        if (!aux.open(QIODevice::ReadOnly)) {
+            stored.remove();
+            return;
+        }
+        stored.write(aux.readAll());
+        stored.close();
+
+        QFile::remove(cachedAuxFile);
+        if (!stored.rename(cachedAuxFile)) {
+            stored.remove();
+        }
     }
-};
 
-bool render_pdf(const QFileInfo &outputFile, const LaTeXDocument &document, QObject *parent = nullptr)
-{
-    const QString command = "pdflatex";
+    // hash of the TeX, the command lists and the version output of their engines;
+    // timeDependent tells if the TeX uses the time of the render
+    QString pdfCacheKey(const QString &texFile, bool *timeDependent = nullptr) const
+    {
+        QFile tex(texFile);
+        if (!tex.open(QIODevice::ReadOnly)) {
+            return {};
+        }
 
-    QTemporaryDir tmp;
-    if (!tmp.isValid()) {
-        return false;
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        // a control word cut by the end of a block is scanned with the next block
+        QByteArray pending;
+        bool usesTime = false;
+        while (!tex.atEnd()) {
+            const QByteArray block = tex.read(1024 * 1024);
+            if (block.isEmpty()) {
+                break;
+            }
+            hash.addData(block);
+            if (!usesTime) {
+                usesTime = hasTimeControlWord(pending + block, pending);
+            }
+        }
+        if (!usesTime && !pending.isEmpty()) {
+            usesTime = hasTimeControlWord(pending + ' ', pending);
+        }
+        if (timeDependent != nullptr) {
+            *timeDependent = usesTime;
+        }
+        for (const auto *commands: {&_commands, &_singlePassCommands}) {
+            hash.addData("\n", 1);
+            for (const auto &command: *commands) {
+                hash.addData(command.name.toUtf8());
+                for (const auto &arg: command.args) {
+                    hash.addData("\t", 1);
+                    hash.addData(arg.toUtf8());
+                }
+                hash.addData("\t", 1);
+                hash.addData(engineVersion(command.name));
+                hash.addData("\n", 1);
+            }
+        }
+        return QString::fromLatin1(hash.result().toHex());
     }
 
-    QString tmpTexFilePath = tmp.filePath("main.tex");
-    QFile tmpTexFile(tmpTexFilePath, parent);
-    if (!tmpTexFile.open(QIODevice::WriteOnly)) {
+    // true if text has a control word that gives the date or time of the render;
+    // an unterminated control word at the end of text is left in pending
+    static bool hasTimeControlWord(const QByteArray &text, QByteArray &pending)
+    {
+        static const QList<QByteArray> words = {
+            "today", "time", "day", "month", "year", "pdfcreationdate", "currenttime", "DTMnow", "DTMtoday"
+        };
+        pending.clear();
+        int position = text.indexOf('\\');
+        while (position >= 0) {
+            int end = position + 1;
+            while (end < text.size() && ((text[end] >= 'a' && text[end] <= 'z') || (text[end] >= 'A' && text[end] <= 'Z'))) {
+                ++end;
+            }
+            if (end == text.size()) {
+                pending = text.mid(position);
+                return false;
+            }
+            if (end > position + 1 && words.contains(text.mid(position + 1, end - position - 1))) {
+                return true;
+            }
+            // a control symbol such as \\ takes the character after the backslash
+            position = text.indexOf('\\', end > position + 1 ? end : end + 1);
+        }
         return false;
     }
 
-    QTextStream tmpTexStream(&tmpTexFile);
-    document.render(tmpTexStream);
-    tmpTexFile.close();
+    // output of `command --version`, asked once per command in the process
+    static QByteArray engineVersion(const QString &command)
+    {
+        static std::mutex mutex;
+        static QHash<QString, QByteArray> versions;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = versions.constFind(command);
+            if (found != versions.constEnd()) {
+                return found.value();
+            }
+        }
 
-    // launch pdflatex 2 times (1st for calculate total size of document)
-    auto outDirParam = QString("-output-directory=%1").arg(tmp.path());
+        QProcess process;
+        process.setProcessChannelMode(QProcess::MergedChannels);
+        process.start(command, {"--version"});
+        QByteArray version;
+        if (process.waitForFinished() && process.exitStatus() == QProcess::NormalExit) {
+            version = process.readAll();
+        }
 
-    QProcess firstPass(parent);
-    firstPass.start(
-        command,
-        {
-            "-draftmode",
-            outDirParam,
-            tmpTexFilePath
-        });
+        std::lock_guard<std::mutex> lock(mutex);
+        versions.insert(command, version);
+        return version;
+    }
 
-    if (!firstPass.waitForFinished()) {
-        return false;
+    inline QString cachedPdfFile(const QString &key) const
+    {
+        return QDir(_pdfCacheDir).absoluteFilePath(key + PdfSuffix);
     }
 
-    QProcess secondPass(parent);
-    secondPass.start(
-        command,
-        {
-            outDirParam,
-            tmpTexFilePath
-        });
+    bool deliverCachedPdf(const QString &key, const QFileInfo &output) const
+    {
+        if (key.isEmpty()) {
+            return false;
+        }
+        const QString cachedPdf = cachedPdfFile(key);
+        if (!QFileInfo::exists(cachedPdf) || !removeExistingOutputFile(output)) {
+            return false;
+        }
+        // the cached PDF may have been evicted meanwhile, the document is rendered then
+        if (!deliverFile(cachedPdf, output.filePath())) {
+            return false;
+        }
 
-    if (!secondPass.waitForFinished()) {
-        return false;
+#ifdef Q_OS_UNIX
+        // the modification time orders the cache for eviction
+        ::utimes(QFile::encodeName(cachedPdf).constData(), nullptr);
+#endif
+        return true;
     }
 
-    if (outputFile.exists()) {
-        QFile(outputFile.filePath()).remove();
-    }
+    void storeCachedPdf(const QString &pdfFile, const QString &key) const
+    {
+        if (key.isEmpty() || !QDir(_pdfCacheDir).mkpath(".")) {
+            return;
+        }
+        const QString cachedPdf = cachedPdfFile(key);
+        if (QFileInfo::exists(cachedPdf)) {
+            return;
+        }
 
-    return QFile::copy(
-        tmp.filePath("main.pdf"),
-        outputFile.filePath());
-}
+        // delivered next to the cached file and renamed, so concurrent renders never read a partial PDF
+        QTemporaryFile reserved(cachedPdf + ".XXXXXX");
+        if (!reserved.open()) {
+            return;
+        }
+        const QString stored = reserved.fileName();
+        reserved.close();
+        reserved.remove();
+        if (!deliverFile(pdfFile, stored)) {
+            return;
+        }
+        if (!QFile::rename(stored, cachedPdf)) {
+            QFile::remove(stored);
+        }
 
-bool render_pdf(const QString &outputFilePath, const LaTeXDocument &document, QObject *parent = nullptr)
-{
-    return render_pdf(
-        QFileInfo(outputFilePath),
-        document,
-        parent);
-}
+        evictCachedPdfs();
+    }
 
-class FileRenderer
-{
-public:
-    virtual bool render(const QFileInfo &output, const BaseDocument &document) = 0;
+    // removes the least recently used PDFs that do not fit into the cache budget
+    void evictCachedPdfs() const
+    {
+        const auto entries = QDir(_pdfCacheDir).entryInfoList({"*" + PdfSuffix}, QDir::Files, QDir::Time);
+        qint64 size = 0;
+        for (const auto &entry: entries) {
+            size += entry.size();
+            if (size > _pdfCacheMaxBytes) {
+                QFile::remove(entry.filePath());
+            }
+        }
+    }
 
-    bool render(const QString &outputPath, const BaseDocument &document)
+    // target, which must not exist, gets the content of source as a reflink (a copy-on-write clone on
+    // file systems that support it) or a copy; never a hard link, so rewriting one file leaves the other
+    static bool deliverFile(const QString &source, const QString &target)
     {
-        return render(QFileInfo(outputPath), document);
+#if defined(Q_OS_LINUX) && defined(FICLONE)
+        const QByteArray sourcePath = QFile::encodeName(source);
+        const QByteArray targetPath = QFile::encodeName(target);
+        int sourceFd = ::open(sourcePath.constData(), O_RDONLY | O_CLOEXEC);
+        if (sourceFd >= 0) {
+            int targetFd = ::open(targetPath.constData(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+            bool cloned = targetFd >= 0 && ::ioctl(targetFd, FICLONE, sourceFd) == 0;
+            if (targetFd >= 0) {
+                ::close(targetFd);
+                if (!cloned) {
+                    ::unlink(targetPath.constData());
+                }
+            }
+            ::close(sourceFd);
+            if (cloned) {
+                return true;
+            }
+        }
+#endif
+        return QFile::copy(source, target);
     }
-};
 
-class TeXFileRenderer final: public FileRenderer
-{
-public:
-    explicit TeXFileRenderer(QObject *parent = nullptr)
-        : _parent(parent)
-    {}
+    static QByteArray fileHash(const QString &path)
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return {};
+        }
 
-    using FileRenderer::render;
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(&file);
+        return hash.result();
+    }
 
-    bool render(const QFileInfo &output, const BaseDocument &document) override
+    // looks for the rerun warnings of LaTeX and packages at the end of the engine log
+    static bool logRequestsRerun(const QString &logPath)
     {
-        QFile outputFile(output.filePath(), _parent);
-        if (!outputFile.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        static const qint64 TailSize = 64 * 1024;
+        static const char *const markers[] = {
+            "Rerun to get",
+            "Label(s) may have changed",
+            "Rerun LaTeX",
+            "Please rerun LaTeX"
+        };
+
+        QFile log(logPath);
+        if (!log.open(QIODevice::ReadOnly)) {
             return false;
         }
-        QTextStream texFileStream(&outputFile);
-        document.render(texFileStream);
-        texFileStream.flush();
-        outputFile.close();
+        if (log.size() > TailSize) {
+            log.seek(log.size() - TailSize);
+        }
+        const QByteArray tail = log.readAll();
+        for (const char *marker: markers) {
+            if (tail.contains(marker)) {
+                return true;
+            }
+        }
 
-        return true;
+        return false;
     }
 
-private:
-    QObject *_parent = nullptr;
-};
+    bool launchCommand(QObject *processParent,
+                       const QString &commandName,
+                       const QStringList &arguments,
+                       RenderState *state = nullptr) const
+    {
+#ifdef Q_OS_UNIX
+        if (_launcher == Launcher::PosixSpawn) {
+            return spawnCommand(commandName, withInteraction(arguments), state);
+        }
+#endif
+        CommandProbe probe;
+        QProcess pdflatex(processParent);
+        bool readsLog = setUpLog(pdflatex, state != nullptr ? state->logFile : QString());
+        pdflatex.setProgram(commandName);
+        pdflatex.setArguments(withInteraction(arguments));
+        pdflatex.start();
 
-class PdfFileRenderer: public FileRenderer
-{
-public:
-    struct CommandDescription
+        bool finished = false;
+        if (readsLog) {
+            LogTail tail(logTailBytes());
+            finished = waitForFinished(pdflatex, tail);
+            if (state != nullptr) {
+                state->report.logTail = tail.bytes();
+            }
+        }
+        else {
+            finished = pdflatex.waitForFinished(_timeoutMSecs);
+        }
+        bool success = finished && pdflatex.exitCode() == 0;
+        probe.record(state != nullptr ? &state->report : nullptr, commandName, pdflatex.arguments(), success);
+        return success;
+    }
+
+#ifdef Q_OS_UNIX
+    // launchCommand through posix_spawnp: the terminal output goes where the log policy says, the process
+    // is killed after the timeout and waited for with wait4, which gives its exact resource usage
+    bool spawnCommand(const QString &commandName, const QStringList &arguments, RenderState *state) const
     {
-        QString name;
-        QStringList args;
+        CommandProbe probe;
+        std::vector<QByteArray> storage;
+        storage.push_back(QFile::encodeName(commandName));
+        for (const auto &argument: arguments) {
+            storage.push_back(argument.toLocal8Bit());
+        }
+        std::vector<char *> argv;
+        for (auto &argument: storage) {
+            argv.push_back(argument.data());
+        }
+        argv.push_back(nullptr);
 
-        CommandDescription(const QString &name, const QStringList &args)
-            : name(name), args(args)
-        {}
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+        int output[2] = {-1, -1};
+        const QByteArray logFile = state != nullptr ? QFile::encodeName(state->logFile) : QByteArray();
+        if (_logPolicy == LogPolicy::Tail && openPipe(output)) {
+            posix_spawn_file_actions_adddup2(&actions, output[1], STDOUT_FILENO);
+        }
+        else if (_logPolicy == LogPolicy::File && !logFile.isEmpty()) {
+            posix_spawn_file_actions_addopen(
+                &actions, STDOUT_FILENO, logFile.constData(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        }
+        else {
+            posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+        }
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
 
-        CommandDescription() = default;
-    };
+        // the engine gets default signal handling whatever the mask of this thread is (see streamIntoFifo)
+        posix_spawnattr_t attributes;
+        posix_spawnattr_init(&attributes);
+        sigset_t signals;
+        sigemptyset(&signals);
+        posix_spawnattr_setsigmask(&attributes, &signals);
+        sigaddset(&signals, SIGPIPE);
+        posix_spawnattr_setsigdefault(&attributes, &signals);
+        short flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+        flags |= POSIX_SPAWN_USEVFORK;
+#endif
+        posix_spawnattr_setflags(&attributes, flags);
 
-    PdfFileRenderer(QObject *parent, int timeoutMSecs, const QVector<CommandDescription> &commands)
-        : _parent(parent), _timeoutMSecs(timeoutMSecs), _commands(commands)
-    {}
+        pid_t pid = 0;
+        int spawned = posix_spawnp(&pid, argv[0], &actions, &attributes, argv.data(), environ);
+        posix_spawn_file_actions_destroy(&actions);
+        posix_spawnattr_destroy(&attributes);
+        if (output[1] >= 0) {
+            ::close(output[1]);
+        }
+        if (spawned != 0) {
+            if (output[0] >= 0) {
+                ::close(output[0]);
+            }
+            probe.record(state != nullptr ? &state->report : nullptr, commandName, arguments, false);
+            return false;
+        }
 
-    PdfFileRenderer(std::initializer_list<CommandDescription> commands)
-        : _parent(nullptr), _timeoutMSecs(50000), _commands(commands)
-    {}
+        LogTail tail(logTailBytes());
+        int status = 0;
+        struct rusage usage;
+        memset(&usage, 0, sizeof(usage));
+        bool finished = waitForSpawned(pid, output[0], tail, status, usage);
+        if (output[0] >= 0) {
+            ::close(output[0]);
+        }
+        if (state != nullptr && _logPolicy == LogPolicy::Tail) {
+            state->report.logTail = tail.bytes();
+        }
 
-    using FileRenderer::render;
+        bool success = finished && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        probe.record(state != nullptr ? &state->report : nullptr, commandName, arguments, success, usage);
+        return success;
+    }
 
-    bool render(const QFileInfo &output, const BaseDocument &document) override final
+    // waits for the spawned process reading output into tail, false if it was killed after the timeout;
+    // the exit is polled through a pidfd where the kernel has it, otherwise with a backoff up to 16 ms
+    bool waitForSpawned(pid_t pid, int output, LogTail &tail, int &status, struct rusage &usage) const
     {
-        QTemporaryDir tmp;
-        QString tmpTexFile;
-        if (!writeTmpTexFile(tmp, document, tmpTexFile)) {
+        int pidFd = -1;
+#if defined(Q_OS_LINUX) && defined(SYS_pidfd_open)
+        pidFd = int(::syscall(SYS_pidfd_open, pid, 0));
+#endif
+        QElapsedTimer timer;
+        timer.start();
+        int backoffMSecs = 1;
+        bool finished = true;
+        while (true) {
+            pid_t reaped = ::wait4(pid, &status, WNOHANG, &usage);
+            if (reaped == pid || (reaped < 0 && errno != EINTR)) {
+                break;
+            }
+
+            int remainingMSecs = _timeoutMSecs < 0 ? -1 : int(_timeoutMSecs - timer.elapsed());
+            if (_timeoutMSecs >= 0 && remainingMSecs <= 0) {
+                ::kill(pid, SIGKILL);
+                while (::wait4(pid, &status, 0, &usage) < 0 && errno == EINTR) {
+                }
+                finished = false;
+                break;
+            }
+
+            struct pollfd fds[2];
+            int count = 0;
+            if (output >= 0) {
+                fds[count++] = {output, POLLIN, 0};
+            }
+            if (pidFd >= 0) {
+                fds[count++] = {pidFd, POLLIN, 0};
+            }
+            int pollMSecs = remainingMSecs;
+            if (pidFd < 0) {
+                pollMSecs = remainingMSecs < 0 ? backoffMSecs : qMin(remainingMSecs, backoffMSecs);
+                backoffMSecs = qMin(backoffMSecs * 2, 16);
+            }
+            if (::poll(fds, nfds_t(count), pollMSecs) > 0 && output >= 0 && fds[0].revents != 0) {
+                if (readOutput(output, tail) <= 0) {
+                    ::close(output);
+                    output = -1;
+                }
+            }
+        }
+
+        // what is left in the pipe, grandchildren may keep it open, so it is not read until its end
+        if (output >= 0) {
+            ::fcntl(output, F_SETFL, ::fcntl(output, F_GETFL) | O_NONBLOCK);
+            while (readOutput(output, tail) > 0) {
+            }
+        }
+        if (pidFd >= 0) {
+            ::close(pidFd);
+        }
+        return finished;
+    }
+
+    // reads a chunk of the pipe into tail, returns its size as read does: 0 at the end of the pipe
+    static ssize_t readOutput(int output, LogTail &tail)
+    {
+        char chunk[16 * 1024];
+        ssize_t read = ::read(output, chunk, sizeof(chunk));
+        while (read < 0 && errno == EINTR) {
+            read = ::read(output, chunk, sizeof(chunk));
+        }
+        if (read > 0) {
+            tail.append(chunk, read);
+        }
+        return read;
+    }
+
+    // a pipe not inherited by processes started meanwhile by other threads
+    static bool openPipe(int fds[2])
+    {
+#ifdef Q_OS_LINUX
+        return ::pipe2(fds, O_CLOEXEC) == 0;
+#else
+        if (::pipe(fds) != 0) {
+            return false;
+        }
+        ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+        ::fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+        return true;
+#endif
+    }
+#endif
+
+    // waits for process as waitForFinished does, reading the output into tail meanwhile,
+    // so QProcess does not buffer the whole output
+    bool waitForFinished(QProcess &process, LogTail &tail) const
+    {
+        if (!process.waitForStarted(_timeoutMSecs)) {
             return false;
         }
-        for (const auto &command: _commands) {
-            if (!launchCommandOverTexFile(tmp.path(), tmpTexFile, command.name, command.args)) {
+
+        QElapsedTimer timer;
+        timer.start();
+        while (process.state() != QProcess::NotRunning) {
+            int remainingMSecs = _timeoutMSecs < 0 ? -1 : int(_timeoutMSecs - timer.elapsed());
+            if (_timeoutMSecs >= 0 && remainingMSecs <= 0) {
+                process.kill();
+                process.waitForFinished();
                 return false;
             }
+            process.waitForReadyRead(remainingMSecs);
+            tail.append(process);
         }
-        if (!removeExistingOutputFile(output)) {
-            return false;
+        tail.append(process);
+
+        return true;
+    }
+
+    // adds -fmt option to the commands of every engine whose format for the preamble is available
+    QVector<CommandDescription> withCachedFormats(const QVector<CommandDescription> &commands,
+                                                  const QString &preamble,
+                                                  QObject *processParent) const
+    {
+        if (_formatCacheDir.isEmpty()) {
+            return commands;
         }
 
-        return QFile::rename(tmp.filePath(TmpPdfFilename), output.filePath());
+        QHash<QString, QString> formats;
+        auto result = commands;
+        for (auto &command: result) {
+            if (!formats.contains(command.name)) {
+                formats.insert(command.name, cachedFormat(command.name, preamble, processParent));
+            }
+            const QString format = formats.value(command.name);
+            if (!format.isEmpty()) {
+                command.args.prepend(QString("-fmt=%1").arg(format));
+            }
+        }
+        return result;
     }
 
-private:
-    QObject *_parent;
-    int _timeoutMSecs;
-    QVector<CommandDescription> _commands;
+    // returns format path (without suffix) for engine and preamble, dumps it on the first use;
+    // returns empty string if the preamble can not be dumped, so documents are rendered without format
+    QString cachedFormat(const QString &engine, const QString &preamble, QObject *processParent) const
+    {
+        QCryptographicHash hash(QCryptographicHash::Sha1);
+        hash.addData(engine.toUtf8());
+        hash.addData("\n", 1);
+        hash.addData(engineVersion(engine));
+        hash.addData("\n", 1);
+        hash.addData(preamble.toUtf8());
+        const QString key = QString::fromLatin1(hash.result().toHex());
 
-    const QString TmpTeXFilename = "main.tex";
-    const QString TmpPdfFilename = "main.pdf";
+        QDir cacheDir(_formatCacheDir);
+        const QString format = cacheDir.absoluteFilePath(key);
+        if (QFileInfo::exists(format + FormatSuffix)) {
+            return format;
+        }
+        // the marker saves a dump per render after a failure, it expires since the failure may be transient
+        QFileInfo failed(format + FailedFormatSuffix);
+        if (failed.exists()) {
+            if (failed.lastModified().secsTo(QDateTime::currentDateTime()) < FailedFormatRetrySecs) {
+                return {};
+            }
+            QFile::remove(failed.filePath());
+        }
+        if (!cacheDir.mkpath(".")) {
+            return {};
+        }
+
+        if (dumpFormat(engine, preamble, key, format + FormatSuffix, processParent)) {
+            return format;
+        }
+
+        markFailedFormat(format);
+        return {};
+    }
 
-    bool writeTmpTexFile(const QTemporaryDir &tmp, const BaseDocument &document, QString &outputTexFile)
+    // drops the -fmt options added by withCachedFormats from commands, returns the formats they named
+    static QStringList dropCachedFormats(QVector<CommandDescription> &commands)
     {
-        QString tmpTexFile = tmp.filePath(TmpTeXFilename);
-        TeXFileRenderer texFileRenderer(_parent);
-        outputTexFile = tmpTexFile;
-        return texFileRenderer.render(tmpTexFile, document);
+        const QString option = QStringLiteral("-fmt=");
+        QStringList formats;
+        for (auto &command: commands) {
+            if (!command.args.isEmpty() && command.args.first().startsWith(option)) {
+                const QString format = command.args.takeFirst().mid(option.size());
+                if (!formats.contains(format)) {
+                    formats.append(format);
+                }
+            }
+        }
+        return formats;
     }
 
-    bool launchCommandOverTexFile(const QString &dir,
-                                  const QString &texFile,
-                                  const QString &commandName,
-                                  const QStringList &commandArgs)
+    // format (path without suffix) is dumped again only when the marker expires
+    void markFailedFormat(const QString &format) const
     {
-        auto launchArguments = commandArgs;
-        launchArguments.append(outputDirOption(dir));
-        launchArguments.append(texFile);
+        QFile failedMarker(format + FailedFormatSuffix);
+        if (failedMarker.open(QIODevice::WriteOnly)) {
+            failedMarker.close();
+        }
+        QFile::remove(format + FormatSuffix);
+    }
 
-        QProcess pdflatex(_parent);
-        pdflatex.setProcessChannelMode(QProcess::MergedChannels);
-        pdflatex.setProgram(commandName);
-        pdflatex.setArguments(launchArguments);
-        pdflatex.start();
+    bool dumpFormat(const QString &engine,
+                    const QString &preamble,
+                    const QString &key,
+                    const QString &formatFile,
+                    QObject *processParent) const
+    {
+        QTemporaryDir tmp;
+        if (!tmp.isValid()) {
+            return false;
+        }
 
-        if (!pdflatex.waitForFinished(_timeoutMSecs)) {
+        const QString preambleFile = tmp.filePath(key + ".tex");
+        QFile preambleTeX(preambleFile);
+        if (!preambleTeX.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            return false;
+        }
+        preambleTeX.write(preamble.toUtf8());
+        preambleTeX.write("\n\\begin{document}\n\\end{document}\n");
+        preambleTeX.close();
+
+        bool dumped = launchCommand(
+            processParent,
+            engine,
+            {
+                "-ini",
+                "-interaction=nonstopmode",
+                "-halt-on-error",
+                QString("-jobname=%1").arg(key),
+                outputDirOption(tmp.path()),
+                QString("&%1").arg(engine),
+                "mylatexformat.ltx",
+                preambleFile
+            });
+        if (!dumped) {
             return false;
         }
 
-        return pdflatex.exitCode() == 0;
+        // other renderers may dump the same format concurrently, the first renamed file wins
+        return QFile::rename(tmp.filePath(key + FormatSuffix), formatFile) || QFileInfo::exists(formatFile);
     }
 
     static bool removeExistingOutputFile(const QFileInfo &outputFileInfo)
@@ -674,6 +5228,9 @@ public:
         {
             {"pdflatex", {"-halt-on-error", "-draftmode"}},
             {"pdflatex", {"-halt-on-error"}}
+        },
+        {
+            {"pdflatex", {"-halt-on-error"}}
         })
     {}
 
@@ -682,6 +5239,9 @@ public:
         {
             {"pdflatex", {"-halt-on-error", "-draftmode"}},
             {"pdflatex", {"-halt-on-error"}}
+        },
+        {
+            {"pdflatex", {"-halt-on-error"}}
         })
     {}
 };
@@ -696,6 +5256,9 @@ public:
         {
             {"lualatex", {"--halt-on-error", "--draftmode"}},
             {"lualatex", {"--halt-on-error"}}
+        },
+        {
+            {"lualatex", {"--halt-on-error"}}
         })
     {}
 
@@ -704,6 +5267,9 @@ public:
         {
             {"lualatex", {"--halt-on-error", "--draftmode"}},
             {"lualatex", {"--halt-on-error"}}
+        },
+        {
+            {"lualatex", {"--halt-on-error"}}
         })
     {}
 };
@@ -0,0 +1,652 @@
+#ifndef PDF_H
+#define PDF_H
+
+#include <QByteArray>
+#include <QFile>
+#include <QHash>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+#include <limits>
+#include <utility>
+
+// parser of the classic (uncompressed xref table) PDF files written by pdflatex and lualatex
+// with \pdfobjcompresslevel=0, enough to read their objects and page tree; file offsets are qint64,
+// while the file is held in one QByteArray, so files over 2 GB are rejected
+class PdfFile
+{
+public:
+    struct Object
+    {
+        // object text between "obj" and "stream"/"endobj"
+        QByteArray value;
+        // raw stream data, copied verbatim
+        QByteArray stream;
+        bool hasStream = false;
+    };
+
+    bool load(const QString &path)
+    {
+        QFile file(path);
+        if (!file.open(QIODevice::ReadOnly)) {
+            return false;
+        }
+        if (file.size() > std::numeric_limits<int>::max()) {
+            return false;
+        }
+        QByteArray data = file.readAll();
+        file.close();
+
+        return parse(data);
+    }
+
+    // parses a whole PDF file held in data
+    bool parse(const QByteArray &data)
+    {
+        _data = data;
+        _version.clear();
+        _root = 0;
+        _offsets.clear();
+        _objects.clear();
+
+        return parseHeader() && parseXrefChain() && parseObjects();
+    }
+
+    inline const QByteArray &version() const
+    {
+        return _version;
+    }
+
+    inline int rootObject() const
+    {
+        return _root;
+    }
+
+    inline const QHash<int, Object> &objects() const
+    {
+        return _objects;
+    }
+
+    // number of the object referenced by key in dictionary text, or 0
+    static int reference(const QByteArray &dictionary, const QByteArray &key)
+    {
+        int position = findKey(dictionary, key);
+        if (position < 0) {
+            return 0;
+        }
+
+        int number = 0;
+        int generation = 0;
+        int end = position;
+        if (readReference(dictionary, position, number, generation, end)) {
+            return number;
+        }
+        return 0;
+    }
+
+    // integer value of key in dictionary text, or -1
+    static qint64 integer(const QByteArray &dictionary, const QByteArray &key)
+    {
+        int position = findKey(dictionary, key);
+        if (position < 0) {
+            return -1;
+        }
+
+        skipWhitespace(dictionary, position);
+        int end = position;
+        while (end < dictionary.size() && isDigit(dictionary[end])) {
+            ++end;
+        }
+        if (end == position) {
+            return -1;
+        }
+        return dictionary.mid(position, end - position).toLongLong();
+    }
+
+    // value text with every "N G R" reference passed through map
+    template<class Map>
+    static QByteArray renumbered(const QByteArray &value, Map map)
+    {
+        QByteArray result;
+        result.reserve(value.size() + 16);
+        int position = 0;
+        while (position < value.size()) {
+            char c = value[position];
+            if (c == '(') {
+                int end = skipLiteralString(value, position);
+                result.append(value.constData() + position, end - position);
+                position = end;
+            }
+            else if (c == '<' && position + 1 < value.size() && value[position + 1] != '<') {
+                int end = value.indexOf('>', position);
+                end = end < 0 ? value.size() : end + 1;
+                result.append(value.constData() + position, end - position);
+                position = end;
+            }
+            else if (c == '/') {
+                // names may contain digits, so they are copied as a whole
+                int end = position + 1;
+                while (end < value.size() && !isDelimiter(value[end]) && !isWhitespace(value[end])) {
+                    ++end;
+                }
+                result.append(value.constData() + position, end - position);
+                position = end;
+            }
+            else if (isDigit(c) && (position == 0 || !isRegular(value[position - 1]))) {
+                int number = 0;
+                int generation = 0;
+                int end = position;
+                if (readReference(value, position, number, generation, end)) {
+                    result.append(QByteArray::number(map(number)));
+                    result.append(" 0 R");
+                }
+                else {
+                    while (end < value.size() && isRegular(value[end])) {
+                        ++end;
+                    }
+                    result.append(value.constData() + position, end - position);
+                }
+                position = end;
+            }
+            else {
+                result.append(c);
+                ++position;
+            }
+        }
+
+        return result;
+    }
+
+private:
+    QByteArray _data;
+    QByteArray _version;
+    int _root = 0;
+    QHash<int, qint64> _offsets;
+    QHash<int, Object> _objects;
+
+    static inline bool isWhitespace(char c)
+    {
+        return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\0';
+    }
+
+    static inline bool isDelimiter(char c)
+    {
+        return c == '(' || c == ')' || c == '<' || c == '>' || c == '[' || c == ']'
+            || c == '{' || c == '}' || c == '/' || c == '%';
+    }
+
+    static inline bool isRegular(char c)
+    {
+        return !isWhitespace(c) && !isDelimiter(c);
+    }
+
+    static inline bool isDigit(char c)
+    {
+        return c >= '0' && c <= '9';
+    }
+
+    static void skipWhitespace(const QByteArray &data, int &position)
+    {
+        while (position < data.size() && isWhitespace(data[position])) {
+            ++position;
+        }
+    }
+
+    static bool readInteger(const QByteArray &data, int &position, qint64 &value)
+    {
+        int end = position;
+        while (end < data.size() && isDigit(data[end])) {
+            ++end;
+        }
+        if (end == position) {
+            return false;
+        }
+        value = data.mid(position, end - position).toLongLong();
+        position = end;
+        return true;
+    }
+
+    // parses "N G R" at position
+    static bool readReference(const QByteArray &data, int position, int &number, int &generation, int &end)
+    {
+        qint64 first = 0;
+        qint64 second = 0;
+        int current = position;
+        if (!readInteger(data, current, first)) {
+            return false;
+        }
+        end = current;
+        skipWhitespace(data, current);
+        if (!readInteger(data, current, second)) {
+            return false;
+        }
+        skipWhitespace(data, current);
+        if (current >= data.size() || data[current] != 'R'
+            || (current + 1 < data.size() && isRegular(data[current + 1]))) {
+            return false;
+        }
+
+        number = int(first);
+        generation = int(second);
+        end = current + 1;
+        return true;
+    }
+
+    // position right after the value of key, or -1
+    static int findKey(const QByteArray &dictionary, const QByteArray &key)
+    {
+        const QByteArray name = "/" + key;
+        int position = 0;
+        while ((position = dictionary.indexOf(name, position)) >= 0) {
+            int end = position + name.size();
+            if (end >= dictionary.size() || !isRegular(dictionary[end])) {
+                return end;
+            }
+            position = end;
+        }
+        return -1;
+    }
+
+    static int skipLiteralString(const QByteArray &data, int position)
+    {
+        int depth = 0;
+        while (position < data.size()) {
+            char c = data[position];
+            if (c == '\\') {
+                position += 2;
+                continue;
+            }
+            if (c == '(') {
+                ++depth;
+            }
+            else if (c == ')' && --depth == 0) {
+                return position + 1;
+            }
+            ++position;
+        }
+        return position;
+    }
+
+    // end of the dictionary starting at position ("<<")
+    static int skipDictionary(const QByteArray &data, int position)
+    {
+        int depth = 0;
+        while (position < data.size()) {
+            char c = data[position];
+            if (c == '(') {
+                position = skipLiteralString(data, position);
+                continue;
+            }
+            if (c == '<' && position + 1 < data.size() && data[position + 1] == '<') {
+                ++depth;
+                position += 2;
+                continue;
+            }
+            if (c == '<') {
+                // hex string
+                int end = data.indexOf('>', position);
+                position = end < 0 ? data.size() : end + 1;
+                continue;
+            }
+            if (c == '>' && position + 1 < data.size() && data[position + 1] == '>') {
+                position += 2;
+                if (--depth == 0) {
+                    return position;
+                }
+                continue;
+            }
+            ++position;
+        }
+        return position;
+    }
+
+    bool parseHeader()
+    {
+        if (!_data.startsWith("%PDF-")) {
+            return false;
+        }
+        int end = 5;
+        while (end < _data.size() && !isWhitespace(_data[end])) {
+            ++end;
+        }
+        _version = _data.mid(5, end - 5);
+        return true;
+    }
+
+    bool parseXrefChain()
+    {
+        int startxref = _data.lastIndexOf("startxref");
+        if (startxref < 0) {
+            return false;
+        }
+        int position = startxref + 9;
+        skipWhitespace(_data, position);
+        qint64 offset = 0;
+        if (!readInteger(_data, position, offset)) {
+            return false;
+        }
+
+        // the newest section is read first, older sections (Prev) do not override its entries
+        QVector<qint64> visited;
+        while (offset > 0 && !visited.contains(offset)) {
+            visited.append(offset);
+            QByteArray trailer;
+            if (!parseXrefSection(offset, trailer)) {
+                return false;
+            }
+            if (_root == 0) {
+                _root = reference(trailer, "Root");
+            }
+            offset = integer(trailer, "Prev");
+        }
+
+        return _root != 0;
+    }
+
+    // positions inside _data are int, as QByteArray indexes are
+    inline bool isInData(qint64 offset) const
+    {
+        return offset >= 0 && offset < _data.size();
+    }
+
+    bool parseXrefSection(qint64 offset, QByteArray &trailer)
+    {
+        if (!isInData(offset)) {
+            return false;
+        }
+        int position = int(offset);
+        skipWhitespace(_data, position);
+        // xref streams (\pdfobjcompresslevel > 0) are not supported
+        if (!_data.mid(position, 4).startsWith("xref")) {
+            return false;
+        }
+        position += 4;
+
+        while (true) {
+            skipWhitespace(_data, position);
+            if (_data.mid(position, 7) == "trailer") {
+                position += 7;
+                skipWhitespace(_data, position);
+                int end = skipDictionary(_data, position);
+                trailer = _data.mid(position, end - position);
+                return true;
+            }
+
+            qint64 first = 0;
+            qint64 count = 0;
+            if (!readInteger(_data, position, first)) {
+                return false;
+            }
+            skipWhitespace(_data, position);
+            if (!readInteger(_data, position, count)) {
+                return false;
+            }
+            for (qint64 i = 0; i < count; ++i) {
+                qint64 offset = 0;
+                qint64 generation = 0;
+                skipWhitespace(_data, position);
+                if (!readInteger(_data, position, offset)) {
+                    return false;
+                }
+                skipWhitespace(_data, position);
+                if (!readInteger(_data, position, generation)) {
+                    return false;
+                }
+                skipWhitespace(_data, position);
+                if (position >= _data.size()) {
+                    return false;
+                }
+                char type = _data[position++];
+                int number = int(first + i);
+                if (type == 'n' && !_offsets.contains(number)) {
+                    _offsets.insert(number, offset);
+                }
+            }
+        }
+    }
+
+    bool parseObjects()
+    {
+        for (auto entry = _offsets.cbegin(); entry != _offsets.cend(); ++entry) {
+            Object object;
+            if (!parseObject(entry.value(), object)) {
+                return false;
+            }
+            _objects.insert(entry.key(), object);
+        }
+        return true;
+    }
+
+    bool parseObject(qint64 offset, Object &object)
+    {
+        if (!isInData(offset)) {
+            return false;
+        }
+        int position = int(offset);
+        qint64 number = 0;
+        qint64 generation = 0;
+        skipWhitespace(_data, position);
+        if (!readInteger(_data, position, number)) {
+            return false;
+        }
+        skipWhitespace(_data, position);
+        if (!readInteger(_data, position, generation)) {
+            return false;
+        }
+        skipWhitespace(_data, position);
+        if (_data.mid(position, 3) != "obj") {
+            return false;
+        }
+        position += 3;
+
+        int valueStart = position;
+        skipWhitespace(_data, position);
+        if (_data.mid(position, 2) == "<<") {
+            int dictionaryEnd = skipDictionary(_data, position);
+            int afterDictionary = dictionaryEnd;
+            skipWhitespace(_data, afterDictionary);
+            if (_data.mid(afterDictionary, 6) == "stream") {
+                object.value = _data.mid(valueStart, dictionaryEnd - valueStart);
+                object.hasStream = true;
+                return readStream(afterDictionary + 6, object);
+            }
+        }
+
+        int end = findObjectEnd(_data, position);
+        if (end < 0) {
+            return false;
+        }
+        object.value = _data.mid(valueStart, end - valueStart);
+        return true;
+    }
+
+    // position of the endobj keyword closing the value at position, strings and comments are skipped,
+    // so "endobj" inside them does not end the object; -1 if there is none
+    static int findObjectEnd(const QByteArray &data, int position)
+    {
+        static const QByteArray keyword = "endobj";
+        while (position < data.size()) {
+            char c = data[position];
+            if (c == '(') {
+                position = skipLiteralString(data, position);
+            }
+            else if (c == '<' && position + 1 < data.size() && data[position + 1] == '<') {
+                position += 2;
+            }
+            else if (c == '<') {
+                int end = data.indexOf('>', position);
+                position = end < 0 ? data.size() : end + 1;
+            }
+            else if (c == '%') {
+                while (position < data.size() && data[position] != '\n' && data[position] != '\r') {
+                    ++position;
+                }
+            }
+            else if (c == 'e' && (position == 0 || !isRegular(data[position - 1]))
+                     && data.mid(position, keyword.size()) == keyword
+                     && (position + keyword.size() >= data.size() || !isRegular(data[position + keyword.size()]))) {
+                return position;
+            }
+            else {
+                ++position;
+            }
+        }
+        return -1;
+    }
+
+    bool readStream(int position, Object &object)
+    {
+        // stream data is followed by an end of line and endstream, found by Length, never by searching
+        if (position < _data.size() && _data[position] == '\r') {
+            ++position;
+        }
+        if (position < _data.size() && _data[position] == '\n') {
+            ++position;
+        }
+
+        qint64 length = integer(object.value, "Length");
+        int lengthObject = reference(object.value, "Length");
+        if (lengthObject != 0) {
+            length = -1;
+            if (_offsets.contains(lengthObject)) {
+                Object lengthValue;
+                if (parseObject(_offsets.value(lengthObject), lengthValue)) {
+                    length = lengthValue.value.trimmed().toLongLong();
+                }
+            }
+        }
+        if (length < 0 || position + length > _data.size()) {
+            return false;
+        }
+
+        object.stream = _data.mid(position, int(length));
+        int end = int(position + length);
+        skipWhitespace(_data, end);
+        return _data.mid(end, 9) == "endstream";
+    }
+};
+
+// joins PDF files page by page: page trees of the inputs become kids of one new page tree.
+// The catalogs of the inputs are dropped, so their outlines (bookmarks), named destinations
+// (Names, Dests) and other document-level entries are lost, as are links that go through them;
+// the pieces of PdfFileRenderer::renderSplit have none unless the preamble adds them
+class PdfConcatenator
+{
+public:
+    static bool concatenate(const QStringList &inputs, const QString &output)
+    {
+        if (inputs.isEmpty()) {
+            return false;
+        }
+
+        QFile out(output);
+        if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            return false;
+        }
+        qint64 written = 0;
+        bool failed = false;
+        // every write is checked, the first failure stops the writing and fails the concatenation
+        auto write = [&out, &written, &failed](const QByteArray &data) {
+            if (failed) {
+                return;
+            }
+            qint64 count = out.write(data);
+            if (count != data.size()) {
+                failed = true;
+                return;
+            }
+            written += count;
+        };
+
+        // object 1 is the new catalog and object 2 the new page tree root
+        QVector<qint64> offsets = {0, 0};
+        QVector<int> pageTrees;
+        qint64 pagesCount = 0;
+        int nextNumber = 3;
+        // inputs are loaded one at a time, so memory is bounded by the largest input
+        for (const auto &input: inputs) {
+            PdfFile file;
+            if (!file.load(input)) {
+                return false;
+            }
+            if (failed) {
+                return false;
+            }
+            if (written == 0) {
+                // pieces come from one engine, so the version of the first one fits all of them
+                write("%PDF-" + file.version() + "\n%\xE2\xE3\xCF\xD3\n");
+            }
+
+            const auto &objects = file.objects();
+            int root = file.rootObject();
+            int pageTree = objects.contains(root) ? PdfFile::reference(objects.value(root).value, "Pages") : 0;
+            if (pageTree == 0 || !objects.contains(pageTree)) {
+                return false;
+            }
+            pagesCount += qMax<qint64>(0, PdfFile::integer(objects.value(pageTree).value, "Count"));
+
+            QHash<int, int> numbers;
+            for (auto object = objects.cbegin(); object != objects.cend(); ++object) {
+                if (object.key() != root) {
+                    numbers.insert(object.key(), nextNumber++);
+                }
+            }
+            pageTrees.append(numbers.value(pageTree));
+
+            auto map = [&numbers](int number) {
+                return numbers.value(number, 0);
+            };
+            for (auto object = objects.cbegin(); object != objects.cend(); ++object) {
+                if (object.key() == root) {
+                    continue;
+                }
+                QByteArray value = PdfFile::renumbered(object.value().value, map);
+                if (object.key() == pageTree) {
+                    int dictionaryStart = value.indexOf("<<");
+                    if (dictionaryStart < 0) {
+                        return false;
+                    }
+                    value.insert(dictionaryStart + 2, QByteArray(" /Parent 2 0 R "));
+                }
+
+                int number = numbers.value(object.key());
+                offsets.resize(qMax(offsets.count(), number));
+                offsets[number - 1] = written;
+                write(QByteArray::number(number) + " 0 obj");
+                write(value);
+                if (object.value().hasStream) {
+                    write("\nstream\n");
+                    write(object.value().stream);
+                    write("\nendstream");
+                }
+                write("\nendobj\n");
+            }
+        }
+
+        offsets[0] = written;
+        write("1 0 obj\n<< /Type /Catalog /Pages 2 0 R >>\nendobj\n");
+        offsets[1] = written;
+        QByteArray kids;
+        for (int pageTree: pageTrees) {
+            kids.append(QByteArray::number(pageTree) + " 0 R ");
+        }
+        write("2 0 obj\n<< /Type /Pages /Kids [ " + kids + "] /Count " + QByteArray::number(pagesCount) + " >>\nendobj\n");
+
+        qint64 xref = written;
+        write("xref\n0 " + QByteArray::number(nextNumber) + "\n");
+        write("0000000000 65535 f \n");
+        for (int number = 1; number < nextNumber; ++number) {
+            write(QByteArray::number(offsets.value(number - 1)).rightJustified(10, '0') + " 00000 n \n");
+        }
+        write("trailer\n<< /Size " + QByteArray::number(nextNumber) + " /Root 1 0 R >>\n");
+        write("startxref\n" + QByteArray::number(xref) + "\n%%EOF\n");
+
+        if (failed || !out.flush()) {
+            return false;
+        }
+        out.close();
+        return out.error() == QFileDevice::NoError;
+    }
+};
+
+#endif //PDF_H